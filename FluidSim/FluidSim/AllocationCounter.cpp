@@ -0,0 +1,42 @@
+#include "AllocationCounter.h"
+#include <cstdlib>
+#include <new>
+
+// Replaces the global allocation functions so AllocationCounter sees every heap allocation
+#ifdef FLUIDSIM_COUNT_ALLOCATIONS
+
+void* operator new(std::size_t size)
+{
+	if (!AllocationCounter::exemptThread) {
+		AllocationCounter::allocations.fetch_add(1, std::memory_order_relaxed);
+	}
+	if (void* p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	if (!AllocationCounter::exemptThread) {
+		AllocationCounter::allocations.fetch_add(1, std::memory_order_relaxed);
+	}
+	return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+
+// Debug counter of global heap allocations, used to check that a solver step never touches the heap.
+// Counting is only active when the program is built with FLUIDSIM_COUNT_ALLOCATIONS and links
+// AllocationCounter.cpp, which replaces the global operator new. Otherwise the counter stays at zero.
+namespace AllocationCounter {
+	inline std::atomic<size_t> allocations{ 0 };
+
+	// Set by background threads (e.g. output writers) whose allocations aren't part of any solver step, so a step
+	// checked on the solver thread doesn't trip over them
+	inline thread_local bool exemptThread = false;
+
+	// Number of allocations made so far
+	inline size_t count() { return allocations.load(std::memory_order_relaxed); }
+}
+
+// Asserts that no heap allocations happen between construction and destruction
+class NoAllocationScope {
+public:
+	explicit NoAllocationScope(bool enabled = true) : m_enabled(enabled), m_start(AllocationCounter::count()) {}
+	~NoAllocationScope() {
+		assert((!m_enabled || AllocationCounter::count() == m_start) && "heap allocation inside a solver step");
+	}
+
+	// Stops checking, for scopes that legitimately had to grow some storage
+	void dismiss() { m_enabled = false; }
+
+	NoAllocationScope(const NoAllocationScope&) = delete;
+	NoAllocationScope& operator=(const NoAllocationScope&) = delete;
+
+private:
+	bool m_enabled;
+	size_t m_start;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef BALANCED_SCHEDULE_H
+#define BALANCED_SCHEDULE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Work schedule for loops whose items cost very different amounts, like particles in a dense pool next to splashing
+// ones. The items are cut into equal-count blocks, the blocks are dealt to the threads as contiguous runs of about
+// equal cost, and a thread that finishes its run early steals blocks from the others' runs. Block costs are what the
+// loop body reported for the block the last time it ran, so the split follows the work as it moves between steps.
+// Every run keeps one cursor per pass, so several passes can share a plan
+class BalancedSchedule {
+public:
+	static const int MaxPasses = 2;
+
+	// Cuts [0, items) into BlocksPerThread blocks per thread. Costs are kept while items and threads stay the same,
+	// otherwise they start out even. Only allocates when items or threads grow
+	void setup(size_t items, int threads) {
+		threads = threads > 0 ? threads : 1;
+		if (items == m_items && threads == m_threads) {
+			return;
+		}
+		m_items = items;
+		m_threads = threads;
+		size_t blocks = static_cast<size_t>(m_threads) * BlocksPerThread;
+		m_blocks = items < blocks ? items : blocks;
+		m_blockCost.assign(m_blocks, 1);
+		if (m_runCapacity < m_threads) {
+			m_runs.reset(new Run[m_threads]);
+			m_runCapacity = m_threads;
+		}
+		partition();
+	}
+
+	// Deals the blocks to the threads as contiguous runs of about equal total cost, and rewinds every pass
+	void partition() {
+		uint64_t total = 0;
+		for (uint64_t cost : m_blockCost) {
+			total += cost;
+		}
+
+		// Run t ends at the first block boundary where the cost so far reaches t + 1 shares
+		size_t block = 0;
+		uint64_t cost = 0;
+		for (int t = 0; t < m_threads; ++t) {
+			m_runs[t].begin = block;
+			uint64_t share = total * (t + 1) / m_threads;
+			while (block < m_blocks && (cost < share || t == m_threads - 1)) {
+				cost += m_blockCost[block++];
+			}
+			m_runs[t].end = block;
+		}
+		rewind();
+	}
+
+	// Restarts a pass, or all of them, over the current plan. Call it while no thread is running the pass
+	void rewind(int pass = -1) {
+		for (int t = 0; t < m_threads; ++t) {
+			for (int p = 0; p < MaxPasses; ++p) {
+				if (pass < 0 || pass == p) {
+					m_runs[t].next[p].store(m_runs[t].begin, std::memory_order_relaxed);
+				}
+			}
+		}
+	}
+
+	// Calls body(begin, end, block, stolen) for the items of the calling thread's run, then for blocks stolen from
+	// the other runs until every block of the pass is done. body returns the block's cost in any unit that is
+	// proportional to its run time. Threads beyond the planned count only steal, so all their blocks are stolen
+	template<typename Body>
+	void run(int thread, int pass, Body&& body) {
+		for (int offset = 0; offset < m_threads; ++offset) {
+			Run& run = m_runs[(thread + offset) % m_threads];
+			for (;;) {
+				size_t block = run.next[pass].fetch_add(1, std::memory_order_relaxed);
+				if (block >= run.end) {
+					break;
+				}
+				size_t begin = m_items * block / m_blocks;
+				size_t end = m_items * (block + 1) / m_blocks;
+				m_blockCost[block] = body(begin, end, block, (thread + offset) % m_threads != thread);
+			}
+		}
+	}
+
+private:
+	// Blocks per thread, enough for stealing to even out the tail at a few atomics per block
+	static const size_t BlocksPerThread = 16;
+
+	// One cache line per run, so threads claiming blocks from their own run don't false-share
+	struct alignas(64) Run {
+		size_t begin = 0, end = 0;
+		std::atomic<size_t> next[MaxPasses];
+	};
+
+	size_t m_items = 0;
+	size_t m_blocks = 0;
+	int m_threads = 0;
+	std::vector<uint64_t> m_blockCost;
+	std::unique_ptr<Run[]> m_runs;
+	int m_runCapacity = 0;
+};
+
+#endif
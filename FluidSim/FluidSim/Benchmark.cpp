@@ -0,0 +1,360 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <omp.h>
+#include "Constants.h"
+#include "Particles.h"
+#include "Scene.h"
+
+// Micro-benchmark: times every ParticleList phase on its own across particle counts and thread counts, and writes
+// the results as CSV or JSON so runs from different commits can be diffed
+//
+// Usage: fluidsim_bench [options], printUsage (--help) lists them
+//
+// With --fused the whole step runs through step() in one parallel region, so only step and the exports are timed
+
+struct BenchOptions {
+	std::vector<size_t> particles = { DAM_PARTICLES, 4000, 40000, 400000, 1000000 };
+	std::vector<size_t> threads; // empty runs 1 and the OpenMP default
+	size_t steps = 20; // timed steps per configuration
+	size_t warmup = 3; // untimed steps first, so the grid and lists are sized and caches are warm
+	bool json = false;
+	std::string output; // empty writes to stdout
+	size_t reorderInterval = 0;
+	bool neighborLists = false;
+	bool symmetric = false;
+	bool fused = false;
+	bool staticSchedule = false;
+	bool fullGridRebuild = false;
+	bool hashGrid = false;
+	SimdIsa isa = detectSimdIsa();
+};
+
+// Timings of one phase over all timed steps of one configuration
+struct PhaseResult {
+	const char* phase;
+	size_t particles;
+	size_t threads;
+	double meanMs;
+	double medianMs;
+	double minMs;
+	double maxMs;
+	double nsPerParticle; // median time divided by the particle count
+};
+
+void printUsage(const char* program)
+{
+	std::cerr << "Usage: " << program << " [options]" << std::endl;
+	std::cerr << "  --particles N,N,...  particle counts to run, defaults to " << DAM_PARTICLES << ",4000,40000,400000,1000000" << std::endl;
+	std::cerr << "  --threads T,T,...  OpenMP thread counts to run, defaults to 1 and the OpenMP default" << std::endl;
+	std::cerr << "  --steps S          timed steps per configuration" << std::endl;
+	std::cerr << "  --warmup W         untimed steps before timing, 0 or more (defaults to 3)" << std::endl;
+	std::cerr << "  --format csv|json  output format, defaults to csv" << std::endl;
+	std::cerr << "  --output FILE      write the results to FILE instead of stdout" << std::endl;
+	std::cerr << "  --reorder K        sort particles into Morton order every K steps" << std::endl;
+	std::cerr << "  --neighbor-lists   reuse Verlet neighbor lists across steps" << std::endl;
+	std::cerr << "  --symmetric        evaluate each particle pair once (Newton's third law)" << std::endl;
+	std::cerr << "  --isa NAME         kernel instruction set (scalar, avx2, avx512), defaults to the widest one this CPU supports" << std::endl;
+	std::cerr << "  --fused            time whole steps run through step() in one parallel region" << std::endl;
+	std::cerr << "  --static-schedule  split the density and force passes evenly by particle index" << std::endl;
+	std::cerr << "  --full-grid-rebuild  sort every particle into the grid each step" << std::endl;
+	std::cerr << "  --hash-grid        bucket particles in a compact hash table instead of the dense grid" << std::endl;
+}
+
+// Parses a positive integer argument (or zero, with allowZero), returns false if it isn't one
+bool parseCount(const char* text, size_t& value, bool allowZero = false)
+{
+	char* end = nullptr;
+	long long parsed = std::strtoll(text, &end, 10);
+	if (end == text || *end != '\0' || parsed < (allowZero ? 0 : 1)) {
+		return false;
+	}
+	value = static_cast<size_t>(parsed);
+	return true;
+}
+
+// Parses a comma separated list of positive integers
+bool parseCountList(const std::string& text, std::vector<size_t>& values)
+{
+	values.clear();
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		size_t value = 0;
+		if (!parseCount(item.c_str(), value)) {
+			return false;
+		}
+		values.push_back(value);
+	}
+	return !values.empty();
+}
+
+bool parseOptions(int argc, char** argv, BenchOptions& options)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h") {
+			return false;
+		}
+
+		// Flags without a value
+		if (arg == "--neighbor-lists") {
+			options.neighborLists = true;
+			continue;
+		}
+		if (arg == "--symmetric") {
+			options.symmetric = true;
+			continue;
+		}
+		if (arg == "--fused") {
+			options.fused = true;
+			continue;
+		}
+		if (arg == "--static-schedule") {
+			options.staticSchedule = true;
+			continue;
+		}
+		if (arg == "--full-grid-rebuild") {
+			options.fullGridRebuild = true;
+			continue;
+		}
+		if (arg == "--hash-grid") {
+			options.hashGrid = true;
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			std::cerr << "Missing value for " << arg << std::endl;
+			return false;
+		}
+		std::string value = argv[++i];
+
+		bool valid = true;
+		if (arg == "--particles" || arg == "-n") {
+			valid = parseCountList(value, options.particles);
+		}
+		else if (arg == "--threads" || arg == "-t") {
+			valid = parseCountList(value, options.threads);
+		}
+		else if (arg == "--steps" || arg == "-s") {
+			valid = parseCount(value.c_str(), options.steps);
+		}
+		else if (arg == "--warmup") {
+			valid = parseCount(value.c_str(), options.warmup, true);
+		}
+		else if (arg == "--reorder") {
+			valid = parseCount(value.c_str(), options.reorderInterval);
+		}
+		else if (arg == "--format") {
+			valid = value == "csv" || value == "json";
+			options.json = value == "json";
+		}
+		else if (arg == "--output" || arg == "-o") {
+			options.output = value;
+		}
+		else if (arg == "--isa") {
+			valid = parseSimdIsa(value, options.isa);
+			if (valid && !simdIsaSupported(options.isa)) {
+				std::cerr << "This CPU doesn't support " << value << std::endl;
+				return false;
+			}
+		}
+		else {
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+
+		if (!valid) {
+			std::cerr << "Invalid value for " << arg << ": " << value << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Runs one configuration and appends a result per phase
+void runConfiguration(const BenchOptions& options, size_t count, size_t threads, std::vector<PhaseResult>& results)
+{
+	omp_set_num_threads(static_cast<int>(threads));
+
+	// Same scene (and random jitter) for every configuration
+	srand(1);
+	ParticleList particles;
+	fitViewToParticles(particles, count);
+	initSPH(particles, count);
+	particles.setReorderInterval(options.reorderInterval);
+	particles.setUseNeighborLists(options.neighborLists);
+	particles.setUseSymmetricPairs(options.symmetric);
+	particles.setSimdIsa(options.isa);
+	particles.setBalancedSchedule(!options.staticSchedule);
+	particles.setIncrementalGrid(!options.fullGridRebuild);
+	particles.setHashGrid(options.hashGrid);
+
+	enum Phase { BuildGrid, Densities, Forces, Integrate, Positions, Export, Step, PhaseCount };
+	static const char* const phaseNames[PhaseCount] = { "buildGrid", "calculateDensities", "calculateForces", "Integrate", "getParticlePositions", "exportPositions", "step" };
+	std::vector<double> samples[PhaseCount];
+
+	typedef std::chrono::steady_clock Clock;
+	auto elapsedMs = [](Clock::time_point from, Clock::time_point to) {
+		return std::chrono::duration<double, std::milli>(to - from).count();
+	};
+
+	std::vector<float> exported(2 * particles.size());
+	size_t checksum = 0; // keeps getParticlePositions from being optimized out
+	for (size_t step = 0; step < options.warmup + options.steps; ++step) {
+		Clock::time_point t0 = Clock::now(), t1, t2, t3;
+		if (options.fused) {
+			particles.step();
+			t1 = t2 = t3 = t0;
+		}
+		else {
+			particles.buildGrid();
+			t1 = Clock::now();
+			particles.calculateDensities();
+			t2 = Clock::now();
+			particles.calculateForces();
+			t3 = Clock::now();
+			particles.Integrate();
+		}
+		Clock::time_point t4 = Clock::now();
+		checksum += particles.getParticlePositions().size();
+		Clock::time_point t5 = Clock::now();
+		particles.exportPositions(exported.data());
+		Clock::time_point t6 = Clock::now();
+
+		if (step < options.warmup) {
+			continue;
+		}
+		if (!options.fused) {
+			samples[BuildGrid].push_back(elapsedMs(t0, t1));
+			samples[Densities].push_back(elapsedMs(t1, t2));
+			samples[Forces].push_back(elapsedMs(t2, t3));
+			samples[Integrate].push_back(elapsedMs(t3, t4));
+		}
+		samples[Positions].push_back(elapsedMs(t4, t5));
+		samples[Export].push_back(elapsedMs(t5, t6));
+		samples[Step].push_back(elapsedMs(t0, t4));
+	}
+	if (checksum == 0) {
+		std::cerr << "No particles were exported" << std::endl;
+	}
+
+	for (int phase = 0; phase < PhaseCount; ++phase) {
+		std::vector<double>& s = samples[phase];
+		if (s.empty()) {
+			continue; // Phases a fused step doesn't time separately
+		}
+		std::sort(s.begin(), s.end());
+		double total = 0.0;
+		for (double ms : s) {
+			total += ms;
+		}
+
+		PhaseResult result;
+		result.phase = phaseNames[phase];
+		result.particles = particles.size();
+		result.threads = threads;
+		result.meanMs = total / s.size();
+		result.medianMs = s.size() % 2 ? s[s.size() / 2] : 0.5 * (s[s.size() / 2 - 1] + s[s.size() / 2]);
+		result.minMs = s.front();
+		result.maxMs = s.back();
+		result.nsPerParticle = result.medianMs * 1.0e6 / particles.size();
+		results.push_back(result);
+	}
+}
+
+void writeCsv(std::ostream& out, const BenchOptions& options, const std::vector<PhaseResult>& results)
+{
+	const char* precision = sizeof(Real) == sizeof(double) ? "double" : "float";
+	out << "precision,isa,neighbor_lists,symmetric,fused,schedule,grid,grid_layout,reorder,particles,threads,phase,mean_ms,median_ms,min_ms,max_ms,ns_per_particle\n";
+	for (const PhaseResult& r : results) {
+		out << precision << ',' << simdIsaName(options.isa) << ',' << options.neighborLists << ',' << options.symmetric << ',' << options.fused << ',' << (options.staticSchedule ? "static" : "balanced") << ','
+			<< (options.fullGridRebuild ? "full" : "incremental") << ',' << (options.hashGrid ? "hash" : "dense") << ','
+			<< options.reorderInterval << ',' << r.particles << ',' << r.threads << ',' << r.phase << ','
+			<< r.meanMs << ',' << r.medianMs << ',' << r.minMs << ',' << r.maxMs << ',' << r.nsPerParticle << '\n';
+	}
+}
+
+void writeJson(std::ostream& out, const BenchOptions& options, const std::vector<PhaseResult>& results)
+{
+	const char* precision = sizeof(Real) == sizeof(double) ? "double" : "float";
+	out << "{\n";
+	out << "  \"precision\": \"" << precision << "\",\n";
+	out << "  \"isa\": \"" << simdIsaName(options.isa) << "\",\n";
+	out << "  \"neighbor_lists\": " << (options.neighborLists ? "true" : "false") << ",\n";
+	out << "  \"symmetric\": " << (options.symmetric ? "true" : "false") << ",\n";
+	out << "  \"fused\": " << (options.fused ? "true" : "false") << ",\n";
+	out << "  \"schedule\": \"" << (options.staticSchedule ? "static" : "balanced") << "\",\n";
+	out << "  \"grid\": \"" << (options.fullGridRebuild ? "full" : "incremental") << "\",\n";
+	out << "  \"grid_layout\": \"" << (options.hashGrid ? "hash" : "dense") << "\",\n";
+	out << "  \"reorder\": " << options.reorderInterval << ",\n";
+	out << "  \"warmup_steps\": " << options.warmup << ",\n";
+	out << "  \"timed_steps\": " << options.steps << ",\n";
+	out << "  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const PhaseResult& r = results[i];
+		out << "    { \"particles\": " << r.particles << ", \"threads\": " << r.threads << ", \"phase\": \"" << r.phase << "\""
+			<< ", \"mean_ms\": " << r.meanMs << ", \"median_ms\": " << r.medianMs << ", \"min_ms\": " << r.minMs
+			<< ", \"max_ms\": " << r.maxMs << ", \"ns_per_particle\": " << r.nsPerParticle << " }"
+			<< (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	out << "  ]\n";
+	out << "}\n";
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	if (options.threads.empty()) {
+		options.threads.push_back(1);
+		size_t defaultThreads = static_cast<size_t>(omp_get_max_threads());
+		if (defaultThreads > 1) {
+			options.threads.push_back(defaultThreads);
+		}
+	}
+
+	// Label the results with the instruction set the kernels really run with, scalar for the symmetric pair kernels
+	// and kernel families without vectorized loops
+	{
+		ParticleList probe;
+		probe.setUseSymmetricPairs(options.symmetric);
+		probe.setHashGrid(options.hashGrid);
+		probe.setSimdIsa(options.isa);
+		options.isa = probe.getActiveSimdIsa();
+	}
+
+	std::vector<PhaseResult> results;
+	for (size_t count : options.particles) {
+		for (size_t threads : options.threads) {
+			std::cerr << "Running " << count << " particles on " << threads << " threads" << std::endl;
+			runConfiguration(options, count, threads, results);
+		}
+	}
+
+	std::ofstream file;
+	if (!options.output.empty()) {
+		file.open(options.output);
+		if (!file) {
+			std::cerr << "Can't open " << options.output << std::endl;
+			return 1;
+		}
+	}
+	std::ostream& out = options.output.empty() ? std::cout : file;
+	if (options.json) {
+		writeJson(out, options, results);
+	}
+	else {
+		writeCsv(out, options, results);
+	}
+
+	return 0;
+}
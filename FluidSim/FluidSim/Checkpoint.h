@@ -0,0 +1,397 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "MappedFile.h"
+#include "OutputQueue.h"
+#include "Particles.h"
+
+// Binary checkpoints of a ParticleList, so a long run can be restarted where it stopped instead of replaying it
+// from initSPH. A checkpoint is one file: a fixed header with the run state and the SPH parameters it was
+// simulated with, then every particle field as a raw array, each starting on a 64 byte boundary:
+//
+//   x, y, vx, vy, fx, fy, rho, p (Scalar[count]), ids (uint32_t[count])
+//
+// Loading maps the file and copies the arrays straight into the particle list, so it runs at memory speed.
+// Writing copies the fields into a staging image first and leaves the disk write to a background thread, so the
+// solver is only held up for the copy. Files are written under a temporary name, flushed to the disk and only then
+// renamed over the old one, so a crash mid-write (even of the machine) leaves the previous checkpoint or the new one,
+// never a truncated file.
+// Loading also restores the SPH parameters the state was simulated with, so a run set up from a scene file
+// carries on with that scene's parameters. Version 2 is little-endian and only loads into a build with the same
+// precision.
+
+struct CheckpointHeader {
+	char magic[8]; // "FSIMCKPT"
+	uint32_t version;
+	uint32_t endianTag; // CheckpointEndianTag as the writer stored it
+	uint32_t headerSize;
+	uint32_t scalarSize; // 4 for float, 8 for double
+	uint64_t particleCount;
+	uint64_t fileSize;
+
+	// Run state
+	uint64_t stepCount;
+	uint64_t nextReorderStep;
+	double simulatedTime;
+	double dt;
+	uint32_t nextId;
+	uint32_t flags; // CheckpointFlags
+	double viewWidth, viewHeight;
+
+	// Parameters the state was simulated with
+	double h, mass, restDensity, gasConstant, viscosity, fixedDt;
+	double gx, gy, boundDamping;
+};
+
+static_assert(std::is_trivially_copyable<CheckpointHeader>::value, "checkpoint header is written as raw bytes");
+
+static const char CheckpointMagic[8] = { 'F', 'S', 'I', 'M', 'C', 'K', 'P', 'T' };
+static const uint32_t CheckpointVersion = 2;
+static const uint32_t CheckpointEndianTag = 0x01020304;
+
+enum CheckpointFlags : uint32_t {
+	CheckpointAdaptiveTimeStep = 1,
+	CheckpointOpenBoundary = 2,
+	CheckpointHashGrid = 4,
+};
+
+// Where each field array starts in a checkpoint of count particles, and the total file size
+struct CheckpointLayout {
+	static const int ScalarFields = 8;
+	static const size_t Alignment = 64;
+
+	size_t fieldOffset[ScalarFields];
+	size_t idsOffset;
+	size_t fileSize;
+
+	CheckpointLayout(size_t count, size_t scalarSize) {
+		size_t offset = align(sizeof(CheckpointHeader));
+		for (int f = 0; f < ScalarFields; ++f) {
+			fieldOffset[f] = offset;
+			offset = align(offset + count * scalarSize);
+		}
+		idsOffset = offset;
+		fileSize = offset + count * sizeof(uint32_t);
+	}
+
+	static size_t align(size_t offset) { return (offset + Alignment - 1) & ~(Alignment - 1); }
+};
+
+// The particle list's field arrays in checkpoint order
+template<typename Scalar>
+void checkpointFields(BasicParticleList<Scalar>& particles, Scalar* fields[CheckpointLayout::ScalarFields])
+{
+	fields[0] = particles.positionsX();
+	fields[1] = particles.positionsY();
+	fields[2] = particles.velocitiesX();
+	fields[3] = particles.velocitiesY();
+	fields[4] = particles.forcesX();
+	fields[5] = particles.forcesY();
+	fields[6] = particles.densities();
+	fields[7] = particles.pressures();
+}
+
+// Serializes the particle list into image, laid out exactly like the checkpoint file. Reuses image's storage
+template<typename Scalar>
+void writeCheckpointImage(BasicParticleList<Scalar>& particles, std::vector<char>& image)
+{
+	const size_t count = particles.size();
+	CheckpointLayout layout(count, sizeof(Scalar));
+	image.resize(layout.fileSize);
+
+	typename BasicParticleList<Scalar>::RunState state = particles.getRunState();
+	CheckpointHeader header = {};
+	std::memcpy(header.magic, CheckpointMagic, sizeof(header.magic));
+	header.version = CheckpointVersion;
+	header.endianTag = CheckpointEndianTag;
+	header.headerSize = sizeof(CheckpointHeader);
+	header.scalarSize = sizeof(Scalar);
+	header.particleCount = count;
+	header.fileSize = layout.fileSize;
+	header.stepCount = state.stepCount;
+	header.nextReorderStep = state.nextReorderStep;
+	header.simulatedTime = state.simulatedTime;
+	header.dt = state.dt;
+	header.nextId = state.nextId;
+	header.flags = (particles.getAdaptiveTimeStep() ? uint32_t(CheckpointAdaptiveTimeStep) : 0u)
+		| (particles.getOpenBoundary() ? uint32_t(CheckpointOpenBoundary) : 0u)
+		| (particles.getHashGrid() ? uint32_t(CheckpointHashGrid) : 0u);
+	header.viewWidth = particles.getViewWidth();
+	header.viewHeight = particles.getViewHeight();
+	const SphParameters<Scalar>& params = particles.getParameters();
+	header.h = params.h;
+	header.mass = params.mass;
+	header.restDensity = params.restDensity;
+	header.gasConstant = params.gasConstant;
+	header.viscosity = params.viscosity;
+	header.fixedDt = params.dt;
+	header.gx = params.gx;
+	header.gy = params.gy;
+	header.boundDamping = params.boundDamping;
+
+	// Padding between the arrays is zeroed so the same state always gives the same bytes
+	std::memset(image.data(), 0, layout.fieldOffset[0]);
+	std::memcpy(image.data(), &header, sizeof(header));
+	Scalar* fields[CheckpointLayout::ScalarFields];
+	checkpointFields(particles, fields);
+	for (int f = 0; f < CheckpointLayout::ScalarFields; ++f) {
+		size_t end = f + 1 < CheckpointLayout::ScalarFields ? layout.fieldOffset[f + 1] : layout.idsOffset;
+		parallelCopy(image.data() + layout.fieldOffset[f], fields[f], count * sizeof(Scalar));
+		std::memset(image.data() + layout.fieldOffset[f] + count * sizeof(Scalar), 0, end - layout.fieldOffset[f] - count * sizeof(Scalar));
+	}
+	parallelCopy(image.data() + layout.idsOffset, particles.particleIds(), count * sizeof(uint32_t));
+}
+
+// Pushes what was written to file through the C library's and the OS's caches to the disk
+inline bool syncFile(FILE* file)
+{
+	if (std::fflush(file) != 0) {
+		return false;
+	}
+#ifdef _WIN32
+	return FlushFileBuffers(reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file)))) != 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Writes bytes to path through the file temporary, which is synced to the disk and then renamed over path. Returns
+// false on any I/O error, leaving path as it was
+inline bool writeFileAtomically(const std::string& path, const std::string& temporary, const char* bytes, size_t size)
+{
+	FILE* file = std::fopen(temporary.c_str(), "wb");
+	if (!file) {
+		return false;
+	}
+	bool written = std::fwrite(bytes, 1, size, file) == size;
+	written = written && syncFile(file);
+	written = std::fclose(file) == 0 && written;
+	if (!written) {
+		std::remove(temporary.c_str());
+		return false;
+	}
+#ifdef _WIN32
+	if (!MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+#else
+	if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+#endif
+		std::remove(temporary.c_str());
+		return false;
+	}
+#ifndef _WIN32
+	// The rename is a change to the directory, which needs a sync of its own to outlast a crash
+	size_t slash = path.find_last_of('/');
+	std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	int descriptor = open(directory.c_str(), O_RDONLY);
+	if (descriptor >= 0) {
+		fsync(descriptor);
+		close(descriptor);
+	}
+#endif
+	return true;
+}
+
+// Writes a checkpoint of the particle list to path, on the calling thread
+template<typename Scalar>
+bool saveCheckpoint(BasicParticleList<Scalar>& particles, const std::string& path)
+{
+	std::vector<char> image;
+	writeCheckpointImage(particles, image);
+	return writeFileAtomically(path, path + ".tmp", image.data(), image.size());
+}
+
+// Writes checkpoints on a background thread (see OutputQueue.h). save() returns once the particle fields are copied
+// into a staging image, so the solver can step on while the file is written. Two images are pooled, so a save only
+// waits when the one before the last is still being written. The images are kept between saves, so periodic
+// checkpoints stop allocating once both have been filled
+class CheckpointWriter {
+public:
+	CheckpointWriter() = default;
+	~CheckpointWriter() { m_queue.stop(); }
+
+	CheckpointWriter(const CheckpointWriter&) = delete;
+	CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+	// Snapshots the particle list and queues it to be written to path. With OutputOverflow::Drop the checkpoint is
+	// skipped instead of waiting when both images are still being written. Returns false if it was skipped or an
+	// earlier write failed
+	template<typename Scalar>
+	bool save(BasicParticleList<Scalar>& particles, const std::string& path, OutputOverflow overflow = OutputOverflow::Wait) {
+		if (!m_queue.isRunning()) {
+			m_queue.start(QueueDepth, [this](Image& image) {
+				if (!writeFileAtomically(image.path, image.temporaryPath, image.bytes.data(), image.bytes.size())) {
+					m_failed.store(true, std::memory_order_relaxed);
+				}
+			});
+		}
+		Image* image = m_queue.acquire(overflow);
+		if (!image) {
+			return false;
+		}
+		writeCheckpointImage(particles, image->bytes);
+		// The pooled image keeps its names, so periodic saves to the same path don't allocate on the solver thread
+		if (image->path != path) {
+			image->path = path;
+			image->temporaryPath.assign(path).append(".tmp");
+		}
+		m_queue.publish();
+		return !m_failed.load(std::memory_order_relaxed);
+	}
+
+	// Waits for the queued writes. Returns false if any write so far failed
+	bool wait() {
+		if (m_queue.isRunning()) {
+			m_queue.drain();
+		}
+		return !m_failed.load(std::memory_order_relaxed);
+	}
+
+	size_t getDropped() { return m_queue.getDropped(); }
+
+private:
+	struct Image {
+		std::vector<char> bytes;
+		std::string path, temporaryPath;
+	};
+
+	static const size_t QueueDepth = 2;
+
+	OutputQueue<Image> m_queue;
+	std::atomic<bool> m_failed{ false };
+};
+
+// Checks a checkpoint's header against this build. Returns false with the reason in error if it can't be loaded
+template<typename Scalar>
+bool checkCheckpointHeader(const CheckpointHeader& header, size_t fileSize, std::string& error)
+{
+	if (std::memcmp(header.magic, CheckpointMagic, sizeof(header.magic)) != 0) {
+		error = "not a checkpoint";
+		return false;
+	}
+	if (header.version != CheckpointVersion || header.headerSize != sizeof(CheckpointHeader)) {
+		error = "unsupported checkpoint version " + std::to_string(header.version);
+		return false;
+	}
+	if (header.endianTag != CheckpointEndianTag) {
+		error = "checkpoint was written on a machine with different byte order";
+		return false;
+	}
+	if (header.scalarSize != sizeof(Scalar)) {
+		error = std::string("checkpoint is ") + (header.scalarSize == sizeof(double) ? "double" : "single")
+			+ " precision, this build is " + (sizeof(Scalar) == sizeof(double) ? "double" : "single");
+		return false;
+	}
+	// Every particle takes at least its fields' bytes, which bounds the count before the layout multiplies it
+	const uint64_t particleBytes = CheckpointLayout::ScalarFields * sizeof(Scalar) + sizeof(uint32_t);
+	if (header.fileSize != fileSize || header.particleCount > fileSize / particleBytes
+		|| CheckpointLayout(static_cast<size_t>(header.particleCount), sizeof(Scalar)).fileSize != fileSize) {
+		error = "checkpoint is truncated or corrupt";
+		return false;
+	}
+	if (header.nextId < header.particleCount) {
+		error = "checkpoint has invalid particle ids";
+		return false;
+	}
+	if (!(header.h > 0) || !(header.mass > 0) || !(header.fixedDt > 0)) {
+		error = "checkpoint has invalid SPH parameters";
+		return false;
+	}
+	return true;
+}
+
+// True if ids holds every id in [0, count) once, which the trajectory writer relies on
+inline bool checkCheckpointIds(const uint32_t* ids, size_t count)
+{
+	std::vector<bool> seen(count, false);
+	for (size_t i = 0; i < count; ++i) {
+		if (ids[i] >= count || seen[ids[i]]) {
+			return false;
+		}
+		seen[ids[i]] = true;
+	}
+	return true;
+}
+
+// Replaces the particle list's particles, run state, SPH parameters, view, time stepping mode, grid and boundary
+// with the checkpoint at path.
+// Returns false with the reason in error, leaving the list as it was, if the file can't be loaded
+template<typename Scalar>
+bool loadCheckpoint(BasicParticleList<Scalar>& particles, const std::string& path, std::string& error)
+{
+	MappedFile file;
+	if (!file.open(path)) {
+		error = "can't open " + path;
+		return false;
+	}
+	CheckpointHeader header;
+	if (file.size() < sizeof(header)) {
+		error = "checkpoint is truncated or corrupt";
+		return false;
+	}
+	std::memcpy(&header, file.data(), sizeof(header));
+	if (!checkCheckpointHeader<Scalar>(header, file.size(), error)) {
+		return false;
+	}
+
+	const size_t count = static_cast<size_t>(header.particleCount);
+	CheckpointLayout layout(count, sizeof(Scalar));
+	const uint32_t* ids = reinterpret_cast<const uint32_t*>(file.data() + layout.idsOffset);
+	if (!checkCheckpointIds(ids, count)) {
+		error = "checkpoint has invalid particle ids";
+		return false;
+	}
+
+	// The parameters were stored as Scalar values converted to double, so they convert back exactly
+	SphParameters<Scalar> params;
+	params.h = static_cast<Scalar>(header.h);
+	params.mass = static_cast<Scalar>(header.mass);
+	params.restDensity = static_cast<Scalar>(header.restDensity);
+	params.gasConstant = static_cast<Scalar>(header.gasConstant);
+	params.viscosity = static_cast<Scalar>(header.viscosity);
+	params.dt = static_cast<Scalar>(header.fixedDt);
+	params.gx = static_cast<Scalar>(header.gx);
+	params.gy = static_cast<Scalar>(header.gy);
+	params.boundDamping = static_cast<Scalar>(header.boundDamping);
+	particles.setParameters(params);
+	particles.setAdaptiveTimeStep((header.flags & CheckpointAdaptiveTimeStep) != 0);
+	particles.setOpenBoundary((header.flags & CheckpointOpenBoundary) != 0);
+	particles.setHashGrid((header.flags & CheckpointHashGrid) != 0);
+	particles.setView(header.viewWidth, header.viewHeight);
+	particles.resizeParticles(count);
+	Scalar* fields[CheckpointLayout::ScalarFields];
+	checkpointFields(particles, fields);
+	for (int f = 0; f < CheckpointLayout::ScalarFields; ++f) {
+		parallelCopy(fields[f], file.data() + layout.fieldOffset[f], count * sizeof(Scalar));
+	}
+	particles.setParticleIds(ids);
+
+	typename BasicParticleList<Scalar>::RunState state;
+	state.stepCount = static_cast<size_t>(header.stepCount);
+	state.nextReorderStep = static_cast<size_t>(header.nextReorderStep);
+	state.simulatedTime = header.simulatedTime;
+	state.dt = static_cast<Scalar>(header.dt);
+	state.nextId = header.nextId;
+	particles.setRunState(state);
+	return true;
+}
+
+#endif
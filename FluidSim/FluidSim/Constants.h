@@ -3,35 +3,123 @@
 
 // This file contains various constants used throughout the code
 
-# define M_PI           3.14159265358979323846
-#include "../../../eigen-3.4.0/Eigen/Dense"
+#include "SmoothingKernels.h"
+
+// Floating point type the solver is built with: float by default, double when FLUIDSIM_DOUBLE is defined
+#ifdef FLUIDSIM_DOUBLE
+typedef double Real;
+#else
+typedef float Real;
+#endif
 
 // Constants for 2D sph borrowed from https://lucasschuermann.com/writing/implementing-sph-in-2d#citation
+// They are defined once per precision so the solver's hot loops never convert between float and double
+template<typename Scalar>
+struct SphConstants {
+	static constexpr Scalar GX = Scalar(0.0), GY = Scalar(-9.81); // external (gravitational) forces
+	static constexpr Scalar REST_DENS = Scalar(300.0); // Rest Density used in Eq. 12
+	static constexpr Scalar GAS_CONST = Scalar(2000.0); // const for equation of state
+	static constexpr Scalar H = Scalar(16.0); // kernel radius
+	static constexpr Scalar HSQ = H * H; // radius^2 for optimization
+	static constexpr Scalar MASS = Scalar(2.5); // assume all particles have the same mass
+	static constexpr Scalar VISC = Scalar(200.0); // viscosity constant
+	static constexpr Scalar DT = Scalar(0.0007); // integration timestep
+
+	// coefficients of the smoothing kernel family the solver is built with (see SmoothingKernels.h)
+	static constexpr Scalar W_DENSITY = Scalar(SmoothingKernel::densityCoefficient(H));
+	static constexpr Scalar W_GRADIENT = Scalar(SmoothingKernel::gradientCoefficient(H));
+	static constexpr Scalar W_LAPLACIAN = Scalar(SmoothingKernel::laplacianCoefficient(H));
+
+	// simulation parameters
+	static constexpr Scalar BOUNDARY = H; // boundary epsilon
+	static constexpr Scalar BOUND_DAMPING = Scalar(-0.5);
+
+	// neighbor search: Verlet list margin beyond H as a fraction of H, lists are rebuilt once a particle moves half
+	// of it. The dam break's fastest particle moves 0.1 to 7 units a step, so they only get reused in small scenes
+	static constexpr Scalar NEIGHBOR_SKIN_FACTOR = Scalar(0.5);
+	static constexpr Scalar NEIGHBOR_SKIN = NEIGHBOR_SKIN_FACTOR * H;
 
-const static Eigen::Vector2d G(0.f, -9.81f);   // external (gravitational) forces
-const static float REST_DENS = 300.f;  // Rest Density used in Eq. 12
-const static float GAS_CONST = 2000.0f; // const for equation of state
-const static float H = 16.0f;		   // kernel radius
-const static float HSQ = H * H;		   // radius^2 for optimization
-const static float MASS = 2.5f;	   // assume all particles have the same mass
-const static float VISC = 200.0f;	   // viscosity constant
-const static float DT = 0.0007f;	   // integration timestep
+	// adaptive time stepping, dt is the smallest of the three criteria clamped to [DT_MIN, DT_MAX].
+	// The force criterion is the one that limits, its factor is calibrated against DT: a settled dam break (whose
+	// largest acceleration, leaving out what the walls take up, puts sqrt(H / a) near 2.6e-3) gets about 1.1 DT.
+	// DT is close to the stability limit of these parameters (a fixed 1.2 DT blows up), so there is little room
+	// above it; adaptive steps mostly guard the violent phases, which run below DT
+	static constexpr Scalar CFL_FACTOR = Scalar(0.4); // dt <= CFL_FACTOR * H / (sound speed + max speed)
+	static constexpr Scalar FORCE_FACTOR = Scalar(0.3); // dt <= FORCE_FACTOR * sqrt(H / max acceleration)
+	static constexpr Scalar VISCOSITY_FACTOR = Scalar(0.125); // dt <= VISCOSITY_FACTOR * H^2 * min density / VISC
+	static constexpr Scalar DT_MIN_FACTOR = Scalar(0.01), DT_MAX_FACTOR = Scalar(1.1); // of DT
+	static constexpr Scalar DT_MIN = DT_MIN_FACTOR * DT;
+	static constexpr Scalar DT_MAX = DT_MAX_FACTOR * DT;
+};
 
+// The SPH parameters a particle list simulates with. They start out as the SphConstants above and can be changed
+// at runtime, e.g. from a scene file (see SceneConfig.h), so a parameter sweep doesn't need a rebuild.
+// The kernel coefficients and the other values derived from the base parameters are computed once by update(),
+// never in the hot loops. The time step criteria factors stay compile-time tuning in SphConstants
+template<typename Scalar>
+struct SphParameters {
+	typedef SphConstants<Scalar> C;
 
-const static float W_POLY6 = 4.f / (M_PI * pow(H, 8.f)); // Eq. 20
-const static float W_SPIKY = -10.f / (M_PI * pow(H, 5.f)); // Eq. 21
-const static float W_VISCOSITY = 40.f / (M_PI * pow(H, 5.f)); // Eq. 22
+	// Base parameters
+	Scalar gx = C::GX, gy = C::GY; // external (gravitational) forces
+	Scalar restDensity = C::REST_DENS;
+	Scalar gasConstant = C::GAS_CONST;
+	Scalar h = C::H; // kernel radius
+	Scalar mass = C::MASS;
+	Scalar viscosity = C::VISC;
+	Scalar dt = C::DT; // fixed integration timestep
+	Scalar boundDamping = C::BOUND_DAMPING;
+	Scalar neighborSkinFactor = C::NEIGHBOR_SKIN_FACTOR; // Verlet list margin beyond h, as a fraction of h
 
-// simulation parameters
-const static float BOUNDARY = H; // boundary epsilon
-const static float BOUND_DAMPING = -0.5f;
+	// Derived by update()
+	Scalar hsq = C::HSQ;
+	Scalar wDensity = C::W_DENSITY, wGradient = C::W_GRADIENT, wLaplacian = C::W_LAPLACIAN;
+	Scalar boundary = C::BOUNDARY;
+	Scalar neighborSkin = C::NEIGHBOR_SKIN;
+	Scalar dtMin = C::DT_MIN, dtMax = C::DT_MAX;
+
+	// Recomputes the derived values from the base parameters, in the same way SphConstants does
+	void update() {
+		hsq = h * h;
+		wDensity = Scalar(SmoothingKernel::densityCoefficient(h));
+		wGradient = Scalar(SmoothingKernel::gradientCoefficient(h));
+		wLaplacian = Scalar(SmoothingKernel::laplacianCoefficient(h));
+		boundary = h;
+		neighborSkin = neighborSkinFactor * h;
+		dtMin = C::DT_MIN_FACTOR * dt;
+		dtMax = C::DT_MAX_FACTOR * dt;
+	}
+
+	// The same base parameters in another precision
+	template<typename Other>
+	SphParameters<Other> convert() const {
+		SphParameters<Other> other;
+		other.gx = static_cast<Other>(gx);
+		other.gy = static_cast<Other>(gy);
+		other.restDensity = static_cast<Other>(restDensity);
+		other.gasConstant = static_cast<Other>(gasConstant);
+		other.h = static_cast<Other>(h);
+		other.mass = static_cast<Other>(mass);
+		other.viscosity = static_cast<Other>(viscosity);
+		other.dt = static_cast<Other>(dt);
+		other.boundDamping = static_cast<Other>(boundDamping);
+		other.neighborSkinFactor = static_cast<Other>(neighborSkinFactor);
+		other.update();
+		return other;
+	}
+};
 
 // interaction
 const static int DAM_PARTICLES = 400;
 
+// simulated time the windowed app advances per published frame when adaptive time stepping is on, in fixed
+// time steps (dt), and the most sub-steps it takes to get there
+const static int FRAME_STEPS = 8;
+const static int MAX_SUBSTEPS = 64;
+
 const static int WINDOW_WIDTH = 800;
 const static int WINDOW_HEIGHT = 600;
 const static double VIEW_WIDTH = 1.0 * 800.f;
 const static double VIEW_HEIGHT = 1.0 * 600.f;
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,489 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <omp.h>
+#include "AllocationCounter.h"
+#include "Checkpoint.h"
+#include "Constants.h"
+#include "Particles.h"
+#include "SceneConfig.h"
+#include "Trace.h"
+#include "Trajectory.h"
+
+// Headless entry point: runs the solver without GLFW/GLEW so it can be run and profiled on compute nodes
+//
+// Usage: fluidsim_headless [options], printUsage (--help) lists them
+
+struct RunOptions {
+	size_t particles = 0; // 0 keeps the scene's dam size, DAM_PARTICLES without a scene
+	int threads = 0; // 0 keeps the OpenMP default
+	size_t steps = 1000;
+	size_t reorderInterval = 0; // 0 never reorders
+	bool neighborLists = false;
+	bool symmetric = false;
+	bool adaptive = false;
+	bool fused = false; // Runs each step in one parallel region (step())
+	bool staticSchedule = false; // Splits the passes evenly by particle index instead of by neighbor cost
+	bool fullGridRebuild = false; // Sorts every particle into the grid each step instead of moving only the ones that changed cell
+	bool hashGrid = false; // Compact hash grid instead of the dense grid over the view
+	bool openBoundary = false; // No walls, particles may leave the view (hash grid only)
+	double frameTime = 0.0; // Simulated seconds per iteration, 0 runs one step per iteration
+	SimdIsa isa = detectSimdIsa();
+	size_t statsInterval = 0; // 0 only prints the stats at the end when --stats-file is given
+	std::string statsFile; // empty writes the stats to stderr
+	std::string traceFile; // empty doesn't trace
+	std::string sceneFile; // empty runs the default dam break
+	std::string restartFile; // empty starts from the scene
+	std::string checkpointFile; // empty doesn't checkpoint
+	size_t checkpointInterval = 0; // 0 only checkpoints at the end
+	std::string trajectoryFile; // empty doesn't record a trajectory
+	size_t trajectoryInterval = 10;
+	bool verifyTrajectory = false; // Reads the trajectory back after the run and compares it to the particles
+};
+
+void printUsage(const char* program)
+{
+	std::cerr << "Usage: " << program << " [options]" << std::endl;
+	std::cerr << "  --particles N      dam break particle count, defaults to the scene's" << std::endl;
+	std::cerr << "  --threads T        OpenMP threads, defaults to the OpenMP default" << std::endl;
+	std::cerr << "  --steps S          iterations to run, defaults to 1000" << std::endl;
+	std::cerr << "  --reorder K        sort particles into Morton order every K steps" << std::endl;
+	std::cerr << "  --neighbor-lists   reuse Verlet neighbor lists across steps" << std::endl;
+	std::cerr << "  --symmetric        evaluate each particle pair once (Newton's third law)" << std::endl;
+	std::cerr << "  --isa NAME         kernel instruction set, defaults to the widest one this CPU supports" << std::endl;
+	std::cerr << "  --stats K          collect per-phase timings and counters, reporting them every K steps" << std::endl;
+	std::cerr << "  --stats-file FILE  write the stats reports to FILE instead of stderr" << std::endl;
+	std::cerr << "  --adaptive         pick each step's dt from the CFL, force and viscosity criteria" << std::endl;
+	std::cerr << "  --frame-time T     advance T simulated seconds per iteration, in as many sub-steps as dt needs" << std::endl;
+	std::cerr << "  --fused            run each step in a single parallel region with spin barriers between phases" << std::endl;
+	std::cerr << "  --static-schedule  split the density and force passes evenly by particle index, without work stealing" << std::endl;
+	std::cerr << "  --full-grid-rebuild  sort every particle into the grid each step, even when few changed cell" << std::endl;
+	std::cerr << "  --hash-grid        bucket particles in a compact hash table sized by particle count, not the view" << std::endl;
+	std::cerr << "  --open-boundary    no walls, particles may leave the view (with --hash-grid)" << std::endl;
+	std::cerr << "  --scene FILE       set up the parameters, view and fluid from a JSON scene FILE (see SceneConfig.h)" << std::endl;
+	std::cerr << "  --restart FILE     continue the run saved in checkpoint FILE instead of starting a new dam break" << std::endl;
+	std::cerr << "  --checkpoint FILE  write a checkpoint of the final state to FILE" << std::endl;
+	std::cerr << "  --checkpoint-every K  also checkpoint every K iterations, written in the background" << std::endl;
+	std::cerr << "  --trajectory FILE  record positions and velocities to a compressed trajectory FILE (see Trajectory.h)" << std::endl;
+	std::cerr << "  --trajectory-every K  record every Kth iteration, defaults to 10" << std::endl;
+	std::cerr << "  --verify-trajectory  read the trajectory back after the run and check its last frame against the particles" << std::endl;
+	std::cerr << "  --trace FILE       write a Chrome trace of the phases and OpenMP worker chunks to FILE" << std::endl;
+}
+
+// Parses a positive integer argument, returns false if it isn't one
+bool parseCount(const char* text, size_t& value)
+{
+	char* end = nullptr;
+	long long parsed = std::strtoll(text, &end, 10);
+	if (end == text || *end != '\0' || parsed <= 0) {
+		return false;
+	}
+	value = static_cast<size_t>(parsed);
+	return true;
+}
+
+bool parseOptions(int argc, char** argv, RunOptions& options)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h") {
+			return false;
+		}
+
+		// Flags without a value
+		if (arg == "--neighbor-lists") {
+			options.neighborLists = true;
+			continue;
+		}
+		if (arg == "--symmetric") {
+			options.symmetric = true;
+			continue;
+		}
+		if (arg == "--adaptive") {
+			options.adaptive = true;
+			continue;
+		}
+		if (arg == "--fused") {
+			options.fused = true;
+			continue;
+		}
+		if (arg == "--verify-trajectory") {
+			options.verifyTrajectory = true;
+			continue;
+		}
+		if (arg == "--static-schedule") {
+			options.staticSchedule = true;
+			continue;
+		}
+		if (arg == "--full-grid-rebuild") {
+			options.fullGridRebuild = true;
+			continue;
+		}
+		if (arg == "--hash-grid") {
+			options.hashGrid = true;
+			continue;
+		}
+		if (arg == "--open-boundary") {
+			options.openBoundary = true;
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			std::cerr << "Missing value for " << arg << std::endl;
+			return false;
+		}
+
+		if (arg == "--isa") {
+			if (!parseSimdIsa(argv[++i], options.isa)) {
+				std::cerr << "Unknown instruction set " << argv[i] << std::endl;
+				return false;
+			}
+			if (!simdIsaSupported(options.isa)) {
+				std::cerr << "This CPU doesn't support " << argv[i] << std::endl;
+				return false;
+			}
+			continue;
+		}
+		if (arg == "--stats-file") {
+			options.statsFile = argv[++i];
+			continue;
+		}
+		if (arg == "--trace") {
+			options.traceFile = argv[++i];
+			continue;
+		}
+		if (arg == "--scene") {
+			options.sceneFile = argv[++i];
+			continue;
+		}
+		if (arg == "--restart") {
+			options.restartFile = argv[++i];
+			continue;
+		}
+		if (arg == "--checkpoint") {
+			options.checkpointFile = argv[++i];
+			continue;
+		}
+		if (arg == "--trajectory") {
+			options.trajectoryFile = argv[++i];
+			continue;
+		}
+		if (arg == "--frame-time") {
+			char* end = nullptr;
+			options.frameTime = std::strtod(argv[++i], &end);
+			if (end == argv[i] || *end != '\0' || !(options.frameTime > 0.0)) {
+				std::cerr << "Invalid value for " << arg << ": " << argv[i] << std::endl;
+				return false;
+			}
+			continue;
+		}
+
+		size_t value = 0;
+		if (!parseCount(argv[++i], value)) {
+			std::cerr << "Invalid value for " << arg << ": " << argv[i] << std::endl;
+			return false;
+		}
+
+		if (arg == "--particles" || arg == "-n") {
+			options.particles = value;
+		}
+		else if (arg == "--threads" || arg == "-t") {
+			options.threads = static_cast<int>(value);
+		}
+		else if (arg == "--steps" || arg == "-s") {
+			options.steps = value;
+		}
+		else if (arg == "--reorder") {
+			options.reorderInterval = value;
+		}
+		else if (arg == "--stats") {
+			options.statsInterval = value;
+		}
+		else if (arg == "--checkpoint-every") {
+			options.checkpointInterval = value;
+		}
+		else if (arg == "--trajectory-every") {
+			options.trajectoryInterval = value;
+		}
+		else {
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+	}
+	if (options.checkpointInterval > 0 && options.checkpointFile.empty()) {
+		std::cerr << "--checkpoint-every needs --checkpoint FILE" << std::endl;
+		return false;
+	}
+	if (options.verifyTrajectory && options.trajectoryFile.empty()) {
+		std::cerr << "--verify-trajectory needs --trajectory FILE" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Reads the trajectory at path back and checks it against the run that wrote it: the frame count, and the last
+// frame, which must be the particles' current state, within half a quantization step of every position and
+// velocity
+bool verifyTrajectory(const std::string& path, ParticleList& particles, size_t frames)
+{
+	TrajectoryReader reader;
+	std::string error;
+	if (!reader.open(path, error)) {
+		std::cerr << "Can't read " << path << ": " << error << std::endl;
+		return false;
+	}
+	if (reader.getFrameCount() != frames || reader.getParticleCount() != particles.size()) {
+		std::cerr << path << " has " << reader.getFrameCount() << " frames of " << reader.getParticleCount()
+			<< " particles, expected " << frames << " of " << particles.size() << std::endl;
+		return false;
+	}
+	if (frames == 0) {
+		return true;
+	}
+	const size_t last = frames - 1;
+	if (reader.getFrameStep(last) != particles.getStepCount()) {
+		std::cerr << "The last frame of " << path << " is step " << reader.getFrameStep(last)
+			<< ", not the final step " << particles.getStepCount() << std::endl;
+		return false;
+	}
+
+	const size_t count = particles.size();
+	std::vector<double> x(count), y(count), vx(count), vy(count);
+	if (!reader.readFrame(last, x.data(), y.data(), vx.data(), vy.data())) {
+		std::cerr << "Frame " << last << " of " << path << " is corrupt" << std::endl;
+		return false;
+	}
+
+	TrajectoryQuantizer quantizer(reader.getHeader());
+	// Rounding in the quantizer and reader may put a value a hair past half a step
+	const double slack = 1.0 + 1e-9;
+	double positionError = 0.0, velocityError = 0.0;
+	size_t mismatches = 0;
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t id = particles.particleIds()[i];
+		double px = particles.positionsX()[i], py = particles.positionsY()[i];
+		double ex = std::abs(x[id] - px), ey = std::abs(y[id] - py);
+		double evx = std::abs(vx[id] - particles.velocitiesX()[i]), evy = std::abs(vy[id] - particles.velocitiesY()[i]);
+		positionError = std::max(positionError, std::max(ex / quantizer.stepX, ey / quantizer.stepY));
+		velocityError = std::max(velocityError, std::max(evx, evy) / quantizer.velocityQuantum);
+		if (ex > 0.5 * quantizer.stepX * slack || ey > 0.5 * quantizer.stepY * slack
+			|| std::max(evx, evy) > 0.5 * quantizer.velocityQuantum * slack) {
+			if (mismatches++ == 0) {
+				std::cerr << "Particle " << id << " is (" << x[id] << ", " << y[id] << ") moving (" << vx[id] << ", " << vy[id]
+					<< ") in " << path << ", but (" << px << ", " << py << ") moving (" << particles.velocitiesX()[i]
+					<< ", " << particles.velocitiesY()[i] << ") in the run" << std::endl;
+			}
+		}
+	}
+	if (mismatches > 0) {
+		std::cerr << mismatches << " of " << count << " particles differ by more than half a quantization step" << std::endl;
+		return false;
+	}
+	std::cout << "Trajectory verified: " << frames << " frames, last frame within " << positionError
+		<< " position steps and " << velocityError << " velocity steps of the run" << std::endl;
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	RunOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	if (options.threads > 0) {
+		omp_set_num_threads(options.threads);
+	}
+
+	ParticleList particles;
+	if (!options.restartFile.empty()) {
+		// The checkpoint brings its own particles, parameters, view, time stepping mode, grid and boundary
+		auto loadStart = std::chrono::steady_clock::now();
+		std::string error;
+		if (!loadCheckpoint(particles, options.restartFile, error)) {
+			std::cerr << "Can't restart from " << options.restartFile << ": " << error << std::endl;
+			return 1;
+		}
+		double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+		std::cout << "Restarted from " << options.restartFile << " at step " << particles.getStepCount()
+			<< " in " << loadMs << " ms" << std::endl;
+		options.adaptive = options.adaptive || particles.getAdaptiveTimeStep();
+		options.hashGrid = options.hashGrid || particles.getHashGrid();
+	}
+	else {
+		SceneConfig scene;
+		std::string error;
+		if (!options.sceneFile.empty() && !loadSceneConfig(options.sceneFile, scene, error)) {
+			std::cerr << "Can't load scene: " << error << std::endl;
+			return 1;
+		}
+		if (options.particles > 0) {
+			scene.damParticles = options.particles;
+		}
+		initScene(particles, scene);
+	}
+	particles.setReorderInterval(options.reorderInterval);
+	particles.setUseNeighborLists(options.neighborLists);
+	particles.setUseSymmetricPairs(options.symmetric);
+	particles.setSimdIsa(options.isa);
+	if (options.adaptive != particles.getAdaptiveTimeStep()) {
+		particles.setAdaptiveTimeStep(options.adaptive);
+	}
+	particles.setBalancedSchedule(!options.staticSchedule);
+	particles.setIncrementalGrid(!options.fullGridRebuild);
+	particles.setHashGrid(options.hashGrid);
+	if (options.openBoundary) {
+		particles.setOpenBoundary(true);
+	}
+
+	std::ofstream statsFile;
+	std::ostream* statsOut = &std::cerr;
+	if (!options.statsFile.empty()) {
+		statsFile.open(options.statsFile);
+		if (!statsFile) {
+			std::cerr << "Can't open " << options.statsFile << std::endl;
+			return 1;
+		}
+		statsOut = &statsFile;
+	}
+	bool collectStats = options.statsInterval > 0 || !options.statsFile.empty();
+	if (collectStats) {
+		particles.getStats().setReportInterval(options.statsInterval, statsOut);
+	}
+
+	// Created up front so recording never allocates
+	std::unique_ptr<TraceRecorder> trace;
+	if (!options.traceFile.empty()) {
+		trace.reset(new TraceRecorder());
+		particles.getStats().setTrace(trace.get());
+	}
+
+	std::cout << "Particles: " << particles.size()
+		<< ", threads: " << omp_get_max_threads()
+		<< ", steps: " << options.steps
+		<< ", precision: " << (sizeof(Real) == sizeof(double) ? "double" : "float")
+		<< ", isa: " << simdIsaName(particles.getActiveSimdIsa())
+		<< ", kernel: " << SmoothingKernel::Name
+		<< ", view: " << particles.getViewWidth() << " x " << particles.getViewHeight() << std::endl;
+	if (particles.getActiveSimdIsa() != particles.getSimdIsa()) {
+		std::cout << "Kernels: " << simdIsaName(particles.getSimdIsa()) << " has no vectorized "
+			<< (particles.symmetricPairsActive() ? "symmetric pair" : SmoothingKernel::Name) << " kernels, running scalar" << std::endl;
+	}
+	if (particles.getUseSymmetricPairs() && !particles.symmetricPairsActive()) {
+		std::cout << "Symmetric pairs: off, they need the dense grid and --hash-grid is on" << std::endl;
+	}
+	if (particles.getOpenBoundary()) {
+		std::cout << "Boundary: " << (particles.openBoundaryActive() ? "open" : "walls, an open boundary needs --hash-grid") << std::endl;
+	}
+
+	CheckpointWriter checkpoints;
+	TrajectoryWriter trajectory;
+	if (!options.trajectoryFile.empty() && !trajectory.open(options.trajectoryFile, particles)) {
+		std::cerr << "Can't write " << options.trajectoryFile << std::endl;
+		return 1;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t step = 0; step < options.steps; ++step) {
+		// The first step sizes the grid, after that a step must not touch the heap unless the neighbor list
+		// storage had to grow (checked in debug builds)
+		size_t listGrowths = particles.getNeighborListGrowths();
+		NoAllocationScope noAllocations(step > 0);
+
+		if (options.frameTime > 0.0) {
+			particles.advance(static_cast<Real>(options.frameTime));
+		}
+		else if (options.fused) {
+			particles.step();
+		}
+		else {
+			particles.buildGrid();
+			particles.calculateDensities();
+			particles.calculateForces();
+			particles.chooseTimeStep();
+			particles.Integrate();
+		}
+
+		if (particles.getNeighborListGrowths() != listGrowths) {
+			noAllocations.dismiss();
+		}
+
+		// Trajectory frames are copied here and compressed and written on the trajectory's own thread
+		if (trajectory.isOpen() && (step + 1) % options.trajectoryInterval == 0 && !trajectory.addFrame(particles)) {
+			std::cerr << "Can't write " << options.trajectoryFile << std::endl;
+			return 1;
+		}
+
+		// Periodic checkpoints copy the fields here and are written while the next steps run. The staging image is
+		// only allocated by the first one
+		if (options.checkpointInterval > 0 && (step + 1) % options.checkpointInterval == 0 && step + 1 < options.steps) {
+			noAllocations.dismiss();
+			if (!checkpoints.save(particles, options.checkpointFile)) {
+				std::cerr << "Can't write " << options.checkpointFile << std::endl;
+			}
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	double seconds = std::chrono::duration<double>(end - start).count();
+	std::cout << "Elapsed: " << seconds << " s, "
+		<< options.steps / seconds << " steps/s" << std::endl;
+	if (options.adaptive || options.frameTime > 0.0) {
+		std::cout << "Solver steps: " << particles.getStepCount()
+			<< ", simulated time: " << particles.getSimulatedTime() << " s"
+			<< ", last dt: " << particles.getTimeStep() << std::endl;
+	}
+	if (options.neighborLists) {
+		std::cout << "Neighbor list rebuilds: " << particles.getNeighborListBuilds()
+			<< ", skin: " << particles.getParameters().neighborSkinFactor << " h" << std::endl;
+	}
+	std::cout << "Grid builds: " << particles.getGridRebuilds() << " full, " << particles.getGridUpdates() << " incremental" << std::endl;
+	if (collectStats && (options.statsInterval == 0 || options.steps % options.statsInterval != 0)) {
+		particles.getStats().report(*statsOut);
+	}
+	if (trajectory.isOpen()) {
+		// Verifying needs a frame of the final state, so a run that doesn't end on a frame records one more
+		if (options.verifyTrajectory && options.steps % options.trajectoryInterval != 0 && !trajectory.addFrame(particles)) {
+			std::cerr << "Can't write " << options.trajectoryFile << std::endl;
+			return 1;
+		}
+		if (!trajectory.close()) {
+			std::cerr << "Can't write " << options.trajectoryFile << std::endl;
+			return 1;
+		}
+		double rawBytes = static_cast<double>(trajectory.getFrameCount()) * particles.size() * 4 * sizeof(Real);
+		std::cout << "Trajectory: " << trajectory.getFrameCount() << " frames, " << trajectory.getBytesWritten() / 1024 << " KiB ("
+			<< (trajectory.getBytesWritten() > 0 ? rawBytes / trajectory.getBytesWritten() : 0.0) << "x smaller than raw), written to " << options.trajectoryFile << std::endl;
+		if (trajectory.getClamped() > 0) {
+			std::cerr << "Warning: " << trajectory.getClamped() << " non-finite or runaway values were stored clamped in " << options.trajectoryFile << std::endl;
+		}
+		if (options.verifyTrajectory && !verifyTrajectory(options.trajectoryFile, particles, trajectory.getFrameCount())) {
+			return 1;
+		}
+	}
+	if (!options.checkpointFile.empty()) {
+		if (!checkpoints.save(particles, options.checkpointFile) || !checkpoints.wait()) {
+			std::cerr << "Can't write " << options.checkpointFile << std::endl;
+			return 1;
+		}
+		std::cout << "Checkpoint at step " << particles.getStepCount() << " written to " << options.checkpointFile << std::endl;
+	}
+	if (trace) {
+		particles.getStats().setTrace(nullptr);
+		if (!trace->write(options.traceFile)) {
+			std::cerr << "Can't write " << options.traceFile << std::endl;
+			return 1;
+		}
+		std::cout << "Trace: " << trace->getRecorded() << " events recorded, written to " << options.traceFile << std::endl;
+	}
+
+	return 0;
+}
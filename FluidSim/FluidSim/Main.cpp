@@ -2,9 +2,17 @@
 #include <GLEW/glew.h>
 #include <GLFW/glfw3.h>
 #include "Shader.h"
-#include "../../../eigen-3.4.0/Eigen/Dense"
+#include <Eigen/Dense>
+#include "Checkpoint.h"
 #include "Constants.h"
 #include "Particles.h"
+#include "SceneConfig.h"
+#include "Trace.h"
+#include "Trajectory.h"
+#include "TripleBuffer.h"
+#include <atomic>
+#include <cstring>
+#include <thread>
 #include <vector>
 #include <windows.h>
 
@@ -14,20 +22,46 @@ void processInput(GLFWwindow* window);
 void renderLoop();
 void initGLFW();
 void endGLFW();
+void loadScene();
 void initSPH();
+void initInstrumentation();
+void initOutput();
+void writeOutput();
 void update();
+void solverLoop();
 
-// Used to track mouse dragging
+// Used to track mouse dragging. The render thread fills in a finished drag and sets mouseReleased, the solver
+// thread applies it and clears the flag, and a new drag is only handed over once the last one was taken
 double pressMouseX, pressMouseY, dragX, dragY;
 bool mousePressed = false;
-bool mouseReleased = false;
+std::atomic<bool> mouseReleased(false);
+double releasedPressX, releasedPressY, releasedDragX, releasedDragY;
+std::atomic<bool> resetRequested(false); // R pressed, the solver thread respawns the dam
+std::atomic<bool> checkpointRequested(false); // C pressed, the solver thread writes a checkpoint
 
 GLFWwindow* window;
 Shader* shader;
 unsigned int VAO, VBO, EBO;
 
-// solver data
+// solver data, only touched by the solver thread once it's running
 ParticleList particles;
+SceneConfig scene; // The default dam break unless FLUIDSIM_SCENE names a scene file
+TraceRecorder* trace = nullptr; // Set when FLUIDSIM_TRACE names a trace file
+
+// Optional output, written on background threads so the solver only pays for copying the fields
+TrajectoryWriter trajectory; // Open when FLUIDSIM_TRAJECTORY names a file
+size_t trajectoryInterval = 10; // Frames between trajectory frames
+size_t outputFrames = 0;
+CheckpointWriter checkpoints;
+const char* checkpointPath = nullptr; // FLUIDSIM_CHECKPOINT
+
+// The solver runs on its own thread and publishes the positions after every step, the render thread draws the
+// latest published snapshot so neither waits on the other (or on vsync)
+TripleBuffer<std::vector<float>> snapshots;
+std::thread solverThread;
+std::atomic<bool> solverRunning(false);
+GLsizei drawnParticles = 0; // Particles in the uploaded snapshot
+size_t vboCapacity = 0; // Floats the VBO's storage holds
 
 // Ensures GPU usage
 extern "C"
@@ -43,51 +77,143 @@ int main() {
 	return 0;
 }
 
-// Initializes SPH by spwaning in the particles, code was modified from Lucas-Schuermann
+// FLUIDSIM_SCENE=FILE sets the parameters, view and fluid up from a scene file (see SceneConfig.h)
+void loadScene()
+{
+	if (const char* path = getenv("FLUIDSIM_SCENE")) {
+		std::string error;
+		if (!loadSceneConfig(path, scene, error)) {
+			std::cerr << "Can't load scene: " << error << ", using the default dam" << std::endl;
+			scene = SceneConfig();
+		}
+	}
+}
+
+// Initializes SPH by spawning in the scene's particles, the dam block by default
 void initSPH(void)
 {
-	for (float y = BOUNDARY + 8 * H; y < VIEW_HEIGHT - BOUNDARY * 2.f; y += H)
-	{
-		for (float x = VIEW_WIDTH / 4; x <= VIEW_WIDTH / 2; x += H)
-		{
-			if (particles.size() < DAM_PARTICLES)
-			{
-				float jitter = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
-				particles.addParticle(Particle(x + jitter, y));
-			}
-			else
-			{
-				return;
-			}
+	initScene(particles, scene);
+}
+
+// Optional step stats and tracing, set up once at startup
+void initInstrumentation()
+{
+	// FLUIDSIM_STATS=K prints the per-phase timings and counters to stderr every K steps
+	if (const char* statsInterval = getenv("FLUIDSIM_STATS")) {
+		particles.getStats().setReportInterval(strtoul(statsInterval, nullptr, 10), &std::cerr);
+	}
+
+	// FLUIDSIM_ADAPTIVE=1 picks each step's dt from the flow instead of the fixed DT
+	if (const char* adaptive = getenv("FLUIDSIM_ADAPTIVE")) {
+		particles.setAdaptiveTimeStep(strcmp(adaptive, "0") != 0);
+	}
+
+	// FLUIDSIM_TRACE=FILE records the phases and OpenMP worker chunks, written as a Chrome trace on exit
+	if (getenv("FLUIDSIM_TRACE")) {
+		trace = new TraceRecorder();
+		particles.getStats().setTrace(trace);
+	}
+}
+
+// Optional checkpoint and trajectory output, set up once at startup after the dam is spawned
+void initOutput()
+{
+	// FLUIDSIM_RESTART=FILE continues the run saved in a checkpoint instead of the fresh dam
+	if (const char* restart = getenv("FLUIDSIM_RESTART")) {
+		std::string error;
+		if (!loadCheckpoint(particles, restart, error)) {
+			std::cerr << "Can't restart from " << restart << ": " << error << std::endl;
+		}
+	}
+
+	// FLUIDSIM_CHECKPOINT=FILE writes a checkpoint there when C is pressed and on exit
+	checkpointPath = getenv("FLUIDSIM_CHECKPOINT");
+
+	// FLUIDSIM_TRAJECTORY=FILE records every FLUIDSIM_TRAJECTORY_EVERY'th frame (10 by default). Frames the writer
+	// has no room for are skipped rather than stalling the solver
+	if (const char* path = getenv("FLUIDSIM_TRAJECTORY")) {
+		if (const char* every = getenv("FLUIDSIM_TRAJECTORY_EVERY")) {
+			trajectoryInterval = strtoul(every, nullptr, 10) > 0 ? strtoul(every, nullptr, 10) : 1;
+		}
+		TrajectoryOptions options;
+		options.overflow = OutputOverflow::Drop;
+		if (!trajectory.open(path, particles, options)) {
+			std::cerr << "Can't write " << path << std::endl;
+		}
+	}
+}
+
+// Hands this frame's output to the writer threads, runs on the solver thread
+void writeOutput()
+{
+	outputFrames++;
+	if (trajectory.isOpen() && outputFrames % trajectoryInterval == 0 && !trajectory.addFrame(particles)) {
+		std::cerr << "Trajectory stopped: the particle count changed or the file can't be written" << std::endl;
+		trajectory.close();
+	}
+	if (checkpointRequested.exchange(false) && checkpointPath) {
+		if (!checkpoints.save(particles, checkpointPath, OutputOverflow::Drop)) {
+			std::cerr << "Can't write " << checkpointPath << std::endl;
 		}
 	}
 }
 
+// Advances the simulation by one step, runs on the solver thread
 void update()
 {
-	// Continue with simulation steps
-	particles.buildGrid();
-	particles.calculateDensities();
-	particles.calculateForces();
+	StepStats::ScopedPhase timer(particles.getStats(), SolverPhase::Update);
 
-	// Make sure this is done AFTER calculate forces, otherwise it will get overriden
-	if (mouseReleased) {
-		mouseReleased = false;
-		Eigen::Vector2d dragForce(dragX * 1000.0f, -dragY * 1000.0f);
+	if (resetRequested.exchange(false)) {
+		particles.clearParticles();
+		initSPH();
+	}
+
+	// With adaptive time stepping a frame covers FRAME_STEPS fixed steps' worth of simulated time in as many
+	// sub-steps as the flow allows, otherwise it's a single fixed step
+	const Real dt = particles.getParameters().dt;
+	Real remaining = particles.getAdaptiveTimeStep() ? FRAME_STEPS * dt : dt;
+	for (int substep = 0; remaining > 0 && substep < MAX_SUBSTEPS; ++substep) {
+		// Steps without a drag to apply run fused in one parallel region
+		if (substep > 0 || !mouseReleased.load(std::memory_order_acquire)) {
+			remaining -= particles.step(remaining);
+			continue;
+		}
+
+		// Continue with simulation steps
+		particles.buildGrid();
+		particles.calculateDensities();
+		particles.calculateForces();
+
+		// Make sure this is done AFTER calculate forces, otherwise it will get overriden
+		Eigen::Vector2d dragForce(releasedDragX * 1000.0f, -releasedDragY * 1000.0f);
 
 		// Apply force to nearby particles
-		particles.applyMouseDragForce(pressMouseX, pressMouseY, dragForce);
-	}
+		particles.applyMouseDragForce(releasedPressX, releasedPressY, dragForce);
+		mouseReleased.store(false, std::memory_order_release);
 
-	particles.Integrate();
+		remaining -= particles.chooseTimeStep(remaining);
+		particles.Integrate();
+	}
+}
 
-	glBindVertexArray(VAO);
-	std::vector<float> particlePositions = particles.getParticlePositions();
-	glBufferData(GL_ARRAY_BUFFER, particlePositions.size() * sizeof(float), particlePositions.data(), GL_DYNAMIC_DRAW);
-	glEnableVertexAttribArray(0);
+// Publishes the current positions for the render thread, the snapshot buffers only reallocate when the particle
+// count changes
+void publishSnapshot()
+{
+	std::vector<float>& positions = snapshots.writeBuffer();
+	positions.resize(2 * particles.size());
+	particles.exportPositions(positions.data());
+	snapshots.publish();
+}
 
-	glBindVertexArray(0);
-	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+// Steps the simulation as fast as it goes until the window closes
+void solverLoop()
+{
+	while (solverRunning.load(std::memory_order_relaxed)) {
+		update();
+		publishSnapshot();
+		writeOutput();
+	}
 }
 
 void initGLFW() {
@@ -122,7 +248,10 @@ void initGLFW() {
 	shader = new Shader("vertex.vert", "fragment.frag");
 	// ///////////////////////////////////////////////////////////////////
 
+	loadScene();
 	initSPH();
+	initInstrumentation();
+	initOutput();
 
 
 	glGenVertexArrays(1, &VAO);
@@ -133,6 +262,8 @@ void initGLFW() {
 	glBindBuffer(GL_ARRAY_BUFFER, VBO);
 	std::vector<float> particlePositions = particles.getParticlePositions();
 	glBufferData(GL_ARRAY_BUFFER, particlePositions.size() * sizeof(float), particlePositions.data(), GL_DYNAMIC_DRAW);
+	drawnParticles = static_cast<GLsizei>(particlePositions.size() / 2);
+	vboCapacity = particlePositions.size();
 
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float),
 		(void*)0);
@@ -143,14 +274,29 @@ void initGLFW() {
 
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 	glPointSize(4.0f);
-	
+
+	solverRunning = true;
+	solverThread = std::thread(solverLoop);
+
 	renderLoop();
+
+	solverRunning = false;
+	solverThread.join();
 }
 
 void endGLFW() {
 	if (shader != nullptr) {
 		delete shader;
 	}
+	trajectory.close();
+	if (checkpointPath && (!checkpoints.save(particles, checkpointPath) || !checkpoints.wait())) {
+		std::cerr << "Can't write " << checkpointPath << std::endl;
+	}
+	if (trace != nullptr) {
+		particles.getStats().setTrace(nullptr);
+		trace->write(getenv("FLUIDSIM_TRACE"));
+		delete trace;
+	}
 	glfwTerminate();
 }
 
@@ -160,17 +306,29 @@ void renderLoop() {
 	{
 		processInput(window);
 		glClear(GL_COLOR_BUFFER_BIT);
-		update();
 
-		int vertexWindowWidthLocation = glGetUniformLocation(shader->ID, "windowWidth");
-		int vertexWindowHeightLocation = glGetUniformLocation(shader->ID, "windowHeight");
+		// Upload the latest step the solver finished, if there's a new one. The VBO's storage is only
+		// re-specified when the particle count grows, otherwise the snapshot is written into it in place
+		if (snapshots.update()) {
+			const std::vector<float>& particlePositions = snapshots.readBuffer();
+			drawnParticles = static_cast<GLsizei>(particlePositions.size() / 2);
+			glBindBuffer(GL_ARRAY_BUFFER, VBO);
+			if (particlePositions.size() > vboCapacity) {
+				vboCapacity = particlePositions.size();
+				glBufferData(GL_ARRAY_BUFFER, vboCapacity * sizeof(float), particlePositions.data(), GL_STREAM_DRAW);
+			}
+			else {
+				glBufferSubData(GL_ARRAY_BUFFER, 0, particlePositions.size() * sizeof(float), particlePositions.data());
+			}
+		}
 
 		shader->use();
 
-		glUniform1i(vertexWindowWidthLocation, WINDOW_WIDTH);
-		glUniform1i(vertexWindowHeightLocation, WINDOW_HEIGHT);
+		// Positions are mapped by the view, which a scene may make larger than the window
+		shader->setFloat("viewWidth", static_cast<float>(particles.getViewWidth()));
+		shader->setFloat("viewHeight", static_cast<float>(particles.getViewHeight()));
 		glBindVertexArray(VAO);
-		glDrawArrays(GL_POINTS, 0, particles.size());
+		glDrawArrays(GL_POINTS, 0, drawnParticles);
 
 		glBindVertexArray(0);
 
@@ -191,8 +349,10 @@ void processInput(GLFWwindow* window)
 	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, true);
 	if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS) {
-		particles.clearParticles();
-		initSPH();
+		resetRequested = true;
+	}
+	if (glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS) {
+		checkpointRequested = true;
 	}
 
 	// Detect mouse press and release
@@ -202,7 +362,6 @@ void processInput(GLFWwindow* window)
 	}
 	if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_RELEASE && mousePressed) {
 		mousePressed = false;
-		mouseReleased = true;
 
 		double releaseX, releaseY;
 		glfwGetCursorPos(window, &releaseX, &releaseY);
@@ -210,5 +369,14 @@ void processInput(GLFWwindow* window)
 		// Compute drag force vector from press to release
 		dragX = releaseX - pressMouseX;
 		dragY = releaseY - pressMouseY;
+
+		// Hand the drag to the solver thread, unless it hasn't applied the previous one yet
+		if (!mouseReleased.load(std::memory_order_acquire)) {
+			releasedPressX = pressMouseX;
+			releasedPressY = pressMouseY;
+			releasedDragX = dragX;
+			releasedDragY = dragY;
+			mouseReleased.store(true, std::memory_order_release);
+		}
 	}
 }
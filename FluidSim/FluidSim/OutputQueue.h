@@ -0,0 +1,142 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "AllocationCounter.h"
+
+// What acquiring an output frame does when every frame is still waiting for the writer
+enum class OutputOverflow {
+	Wait, // Hold the producer up until the writer frees one
+	Drop, // Skip this output
+};
+
+// Hands frames of output (trajectory frames, checkpoint images, ...) from the solver to a writer thread, so the
+// solver only pays for filling a buffer and the serialization and disk writes overlap the next steps.
+// The frames come from a fixed pool: the producer acquire()s a free one, fills it and publish()es it, the writer
+// thread consumes them in order and hands them back. Frames keep their storage between uses, so once every pool
+// frame has been filled once nothing allocates. When all frames are waiting for the writer, acquire either waits
+// for one or gives up, dropping that output, whichever the producer asks for.
+template<typename Frame>
+class OutputQueue {
+public:
+	OutputQueue() = default;
+	~OutputQueue() { stop(); }
+
+	OutputQueue(const OutputQueue&) = delete;
+	OutputQueue& operator=(const OutputQueue&) = delete;
+
+	// Creates a pool of depth frames and starts the writer thread, which calls consume(frame) for every published
+	// frame. Stops a queue that is already running first
+	void start(size_t depth, std::function<void(Frame&)> consume) {
+		stop();
+		m_depth = depth > 0 ? depth : 1;
+		m_frames.reset(new Frame[m_depth]);
+		m_consume = std::move(consume);
+		m_head = m_tail = 0;
+		m_dropped = 0;
+		m_stopping = false;
+		m_thread = std::thread([this]() { writerLoop(); });
+	}
+
+	bool isRunning() const { return m_thread.joinable(); }
+
+	// Pool frames, e.g. to size them up front. Only while no frame is in flight
+	size_t getDepth() const { return m_depth; }
+	Frame& getFrame(size_t i) { return m_frames[i]; }
+
+	// Producer side: a free frame to fill, or nullptr if the writer is depth frames behind and overflow is Drop.
+	// Every acquired frame must be published before the next acquire
+	Frame* acquire(OutputOverflow overflow = OutputOverflow::Wait) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (overflow == OutputOverflow::Drop && m_head - m_tail >= m_depth) {
+			m_dropped++;
+			return nullptr;
+		}
+		m_space.wait(lock, [this]() { return m_head - m_tail < m_depth; });
+		return &m_frames[m_head % m_depth];
+	}
+	void publish() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_head++;
+		}
+		m_ready.notify_one();
+	}
+
+	// Waits until the writer has consumed every published frame
+	void drain() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_space.wait(lock, [this]() { return m_head == m_tail; });
+	}
+
+	// Consumes what is left and stops the writer thread
+	void stop() {
+		if (!m_thread.joinable()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+		}
+		m_ready.notify_one();
+		m_thread.join();
+	}
+
+	// Frames acquire gave up on since start
+	size_t getDropped() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_dropped;
+	}
+
+private:
+	void writerLoop() {
+		AllocationCounter::exemptThread = true;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (;;) {
+			m_ready.wait(lock, [this]() { return m_head != m_tail || m_stopping; });
+			if (m_head == m_tail) {
+				return;
+			}
+			Frame& frame = m_frames[m_tail % m_depth];
+			lock.unlock();
+			m_consume(frame);
+			lock.lock();
+			m_tail++;
+			m_space.notify_all();
+		}
+	}
+
+	std::unique_ptr<Frame[]> m_frames;
+	size_t m_depth = 0;
+	std::function<void(Frame&)> m_consume;
+
+	// Frames [m_tail, m_head) are waiting for the writer
+	size_t m_head = 0, m_tail = 0;
+	size_t m_dropped = 0;
+	bool m_stopping = false;
+	std::mutex m_mutex;
+	std::condition_variable m_ready, m_space;
+	std::thread m_thread;
+};
+
+// Copies a large block with all threads, so filling an output frame holds the solver up as little as possible, and
+// page faults on a fresh mapping are taken in parallel too
+inline void parallelCopy(void* destination, const void* source, size_t bytes)
+{
+	const size_t ChunkBytes = size_t(1) << 20;
+	const ptrdiff_t chunks = static_cast<ptrdiff_t>((bytes + ChunkBytes - 1) / ChunkBytes);
+	#pragma omp parallel for schedule(static)
+	for (ptrdiff_t c = 0; c < chunks; ++c) {
+		size_t begin = static_cast<size_t>(c) * ChunkBytes;
+		size_t length = bytes - begin < ChunkBytes ? bytes - begin : ChunkBytes;
+		std::memcpy(static_cast<char*>(destination) + begin, static_cast<const char*>(source) + begin, length);
+	}
+}
+
+#endif
@@ -1,38 +1,45 @@
 #ifndef PARTICLE_H
 #define PARTICLE_H
 
-#include "../../../eigen-3.4.0/Eigen/Dense"
+#include <Eigen/Dense>
+#include "Constants.h"
 
-// Class representing a single particle
-class Particle
+// Class representing a single particle, at the given floating point precision
+template<typename Scalar>
+class BasicParticle
 {
 public:
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
+	typedef Eigen::Matrix<Scalar, 2, 1> Vector2;
+
 	// Constructor
-	Particle(float x, float y) {
-		m_position = Eigen::Vector2d(x, y); // position
-		m_velocity = Eigen::Vector2d(0.0f, 0.0f); // velocity
-		m_force = Eigen::Vector2d(0.0f, 0.0f); // force
+	BasicParticle(Scalar x, Scalar y) {
+		m_position = Vector2(x, y); // position
+		m_velocity = Vector2(0.0f, 0.0f); // velocity
+		m_force = Vector2(0.0f, 0.0f); // force
 		m_rho = 0.0f; // density
 		m_p = 0.0f; // pressure
 	}
-	
+
 	// Getters/Setters
-	Eigen::Vector2d getPosition() { return m_position; }
-	Eigen::Vector2d getVelocity() { return m_velocity; }
-	Eigen::Vector2d getForce() { return m_force; }
-	float getRho() { return m_rho; }
-	float getP() { return m_p; }
-	void setPosition(Eigen::Vector2d position) { m_position = position; }
-	void setVelocity(Eigen::Vector2d velocity) { m_velocity = velocity; }
-	void setForce(Eigen::Vector2d force) { m_force = force; }
-	void setRho(float rho) { m_rho = rho; }
-	void setP(float p) { m_p = p; }
+	Vector2 getPosition() { return m_position; }
+	Vector2 getVelocity() { return m_velocity; }
+	Vector2 getForce() { return m_force; }
+	Scalar getRho() { return m_rho; }
+	Scalar getP() { return m_p; }
+	void setPosition(Vector2 position) { m_position = position; }
+	void setVelocity(Vector2 velocity) { m_velocity = velocity; }
+	void setForce(Vector2 force) { m_force = force; }
+	void setRho(Scalar rho) { m_rho = rho; }
+	void setP(Scalar p) { m_p = p; }
 
 private:
-	Eigen::Vector2d m_position, m_velocity, m_force;
-	float m_rho, m_p;
+	Vector2 m_position, m_velocity, m_force;
+	Scalar m_rho, m_p;
 };
 
-#endif
\ No newline at end of file
+// Particle at the precision the solver is built with
+typedef BasicParticle<Real> Particle;
+
+#endif
@@ -1,53 +1,707 @@
 #ifndef PARTICLES_H
 #define PARTICLES_H
 
-#include "../../../eigen-3.4.0/Eigen/Dense"
+#include <Eigen/Dense>
+#include "Constants.h"
 #include "Particle.h"
-#include <unordered_map>
+#include "BalancedSchedule.h"
+#include "SimdKernels.h"
+#include "SpinBarrier.h"
+#include "StepStats.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <vector>
 #include <omp.h>
 
 // Code is HEAVILY influenced by https://lucasschuermann.com/writing/implementing-sph-in-2d#citation
 
-// Structures the particles into grids which can help speed up calculations
-struct GridCell {
-	std::vector<size_t> particleIndices; // Stores indices of particles in the cell
-};
-
 // Class representing the list of particles, as well as operations performed on them
-class ParticleList {
+// Particles are stored as a structure of arrays so the hot loops only stream the fields they use
+// Scalar is the floating point type of every particle field and of the kernel math, see Real in Constants.h
+template<typename Scalar>
+class BasicParticleList {
 public:
-	std::unordered_map<int, GridCell> grid; // Spatial hash grid
+	typedef SphConstants<Scalar> C;
+	typedef BasicParticle<Scalar> ParticleType;
+	typedef typename ParticleType::Vector2 Vector2;
 
-	int computeGridIndex(const Eigen::Vector2d& pos) {
-		int x = static_cast<int>(pos(0) / H);
-		int y = static_cast<int>(pos(1) / H);
-		return (x * 73856093) + (y * 19349663); // Unique hash for cell index
+	// Returns the column and row of the cell a position falls in, clamped to the grid. A hash grid has no bounds,
+	// its cells are numbered from the origin in both directions
+	void computeGridCoords(Scalar px, Scalar py, int& x, int& y) {
+		if (m_hashGrid) {
+			x = static_cast<int>(std::floor(px / m_cellSize));
+			y = static_cast<int>(std::floor(py / m_cellSize));
+			return;
+		}
+		x = static_cast<int>(px / m_cellSize);
+		y = static_cast<int>(py / m_cellSize);
+		x = x < 0 ? 0 : (x >= m_gridWidth ? m_gridWidth - 1 : x);
+		y = y < 0 ? 0 : (y >= m_gridHeight ? m_gridHeight - 1 : y);
 	}
 
-	// Builds the particle grid
+	// Returns the cell a position falls in, cells are laid out row by row over the view. With a hash grid it's the
+	// cell's slot in the hash table instead
+	int computeGridIndex(Scalar px, Scalar py) {
+		int x, y;
+		computeGridCoords(px, py, x, y);
+		if (m_hashGrid) {
+			return static_cast<int>(hashCell(x, y));
+		}
+		return y * m_gridWidth + x;
+	}
+
+	// Compact hash grid (Ihmsen et al. 2011) instead of the dense grid over the view: cells are hashed into a table of
+	// about HashSlotsPerParticle slots per particle, so memory follows the particle count rather than the domain
+	// and particles may go anywhere, including negative coordinates. Particles are sorted by slot (handle sort),
+	// so a slot's particles are contiguous as with the dense grid. Cells that collide share a slot: a stencil
+	// visits such a slot once, and the other cell's particles are out of range and fail the distance test.
+	// The symmetric pair passes rely on the dense grid's geometry and aren't used with it
+	void setHashGrid(bool hashed) {
+		m_hashGrid = hashed;
+		m_neighborListsValid = false;
+	}
+	bool getHashGrid() { return m_hashGrid; }
+	size_t getHashTableSize() { return m_hashTableSize; }
+
+	// Slot of cell (x, y), from the cell's Z-order (Morton) index. Unlike the usual XOR of large primes (Teschner et
+	// al. 2003) this keeps nearby cells in nearby slots, so the slot-sorted particles keep their spatial locality as
+	// with Ihmsen et al.'s z-index sort. The Morton bits above the table size are mixed in as an offset, otherwise
+	// every cell would collide with the ones a whole table's worth of Morton codes away
+	uint32_t hashCell(int x, int y) {
+		return hashMorton(interleaveBits32(static_cast<uint32_t>(x)) | (interleaveBits32(static_cast<uint32_t>(y)) << 1));
+	}
+	uint32_t hashMorton(uint64_t morton) {
+		uint64_t offset = (morton >> m_hashTableBits) * 0x9E3779B97F4A7C15ull;
+		return static_cast<uint32_t>((morton + (offset >> 32)) & (m_hashTableSize - 1));
+	}
+
+	// Builds the particle grid by counting sort: particles are bucketed by cell into m_cellParticles,
+	// and cell c owns m_cellParticles[m_cellStart[c], m_cellEnd[c]).
+	// With neighbor lists enabled, the grid and lists are only rebuilt once the cached lists go stale
 	void buildGrid() {
-		grid.clear(); // Reset grid each frame
-		for (size_t i = 0; i < m_particles.size(); ++i) {
-			int cellIndex = computeGridIndex(m_particles[i].getPosition());
-			grid[cellIndex].particleIndices.push_back(i);
+		#pragma omp parallel
+		buildGridOnTeam();
+	}
+
+	// buildGrid's work on the calling team, a team of one outside a parallel region
+	void buildGridOnTeam() {
+		#pragma omp single
+		{
+			m_stats.beginPhase(SolverPhase::BuildGrid);
+			size_t team = static_cast<size_t>(omp_get_num_threads());
+			if (m_teamSlots.size() < team) {
+				m_teamSlots.resize(team);
+			}
+		}
+
+		const bool rebuild = !m_useNeighborLists || !neighborListsValid();
+		if (rebuild) {
+			#pragma omp single
+			resizeGrid();
+
+			// Periodically restore spatial locality before bucketing
+			if (m_reorderInterval > 0 && m_stepCount >= m_nextReorderStep) {
+				reorderParticles();
+				#pragma omp single
+				m_nextReorderStep = m_stepCount + m_reorderInterval;
+			}
+
+			const bool updated = m_incrementalGrid && updateCells();
+			if (!updated) {
+				sortIntoCells();
+			}
+			#pragma omp single
+			{
+				if (updated) {
+					m_gridUpdates++;
+				}
+				else {
+					m_gridRebuilds++;
+				}
+				m_cellsCurrent = true;
+			}
+			if (m_stats.isEnabled()) {
+				recordGridOccupancy();
+			}
+
+			if (m_useNeighborLists) {
+				buildNeighborLists();
+			}
+		}
+
+		#pragma omp single
+		{
+			if (m_useNeighborLists) {
+				m_stats.recordNeighborLists(rebuild);
+			}
+			m_stats.endPhase(SolverPhase::BuildGrid);
+		}
+	}
+
+	// Caches a Verlet list per particle holding every particle within h + the skin (SphParameters::neighborSkin).
+	// The lists stay correct until some particle has moved more than half the skin, so the density and force
+	// passes can reuse them for many steps instead of scanning the cell stencil
+	void setUseNeighborLists(bool use) {
+		m_useNeighborLists = use;
+		m_neighborListsValid = false;
+	}
+	bool getUseNeighborLists() { return m_useNeighborLists; }
+
+	// Number of times the neighbor lists have been rebuilt, and how many of those had to grow their storage
+	size_t getNeighborListBuilds() { return m_neighborListBuilds; }
+	size_t getNeighborListGrowths() { return m_neighborListGrowths; }
+
+	// True while no particle has moved more than half the skin since the lists were built
+	bool neighborListsValid() {
+		if (!m_neighborListsValid || m_listX.size() != size()) {
+			return false;
+		}
+
+		Scalar maxDisplacement2 = 0.0;
+		#pragma omp for nowait
+		for (size_t i = 0; i < size(); ++i) {
+			Scalar dx = m_x[i] - m_listX[i];
+			Scalar dy = m_y[i] - m_listY[i];
+			maxDisplacement2 = std::max(maxDisplacement2, dx * dx + dy * dy);
+		}
+		m_teamSlots[omp_get_thread_num()].displacement2 = maxDisplacement2;
+		#pragma omp barrier
+		for (int t = 0; t < omp_get_num_threads(); ++t) {
+			maxDisplacement2 = std::max(maxDisplacement2, m_teamSlots[t].displacement2);
+		}
+
+		Scalar halfSkin = 0.5 * m_params.neighborSkin;
+		return maxDisplacement2 <= halfSkin * halfSkin;
+	}
+
+	// Only moves the particles that changed cell instead of sorting them all again when few did. On by default
+	void setIncrementalGrid(bool incremental) { m_incrementalGrid = incremental; }
+	bool getIncrementalGrid() { return m_incrementalGrid; }
+
+	// Number of grid builds that sorted every particle, and that only moved the particles that changed cell
+	size_t getGridRebuilds() { return m_gridRebuilds; }
+	size_t getGridUpdates() { return m_gridUpdates; }
+
+	// Moves the particles that changed cell since the last build, giving the grid sortIntoCells would build.
+	// Returns false without touching the grid if it isn't current or too many particles moved
+	bool updateCells() {
+		if (!m_cellsCurrent) {
+			return false;
+		}
+
+		// Find the movers, each thread into its own slice of m_movers as cell << 32 | index
+		const size_t n = size();
+		const uint32_t* particleCell = m_particleCell.data();
+		const size_t thread = static_cast<size_t>(omp_get_thread_num());
+		const size_t team = static_cast<size_t>(omp_get_num_threads());
+		const size_t slice = m_movers.size() / team;
+		uint64_t* out = m_movers.data() + thread * slice;
+		size_t count = 0;
+		bool overflow = false;
+		for (size_t i = n * thread / team; i < n * (thread + 1) / team; ++i) {
+			uint32_t cell = static_cast<uint32_t>(computeGridIndex(m_x[i], m_y[i]));
+			if (cell != particleCell[i]) {
+				if (count == slice) {
+					overflow = true;
+					break;
+				}
+				out[count++] = (static_cast<uint64_t>(cell) << 32) | i;
+			}
+		}
+		m_teamSlots[thread].movers = count;
+		m_teamSlots[thread].overflow = overflow;
+		#pragma omp barrier
+		size_t movers = 0;
+		for (size_t t = 0; t < team; ++t) {
+			movers += m_teamSlots[t].movers;
+			overflow = overflow || m_teamSlots[t].overflow;
+		}
+		if (overflow) {
+			return false;
+		}
+		if (movers != 0) {
+			#pragma omp single
+			mergeMovers(movers, team);
+		}
+		return true;
+	}
+
+	// The serial half of updateCells: moves the movers the team found to their new cells and shifts the offsets
+	void mergeMovers(size_t movers, size_t team) {
+		// Gather the slices and sort the movers by new cell and index, the grid's order
+		size_t gathered = 0;
+		for (size_t t = 0; t < team && gathered < movers; ++t) {
+			const uint64_t* slice = m_movers.data() + t * (m_movers.size() / team);
+			std::copy(slice, slice + m_teamSlots[t].movers, m_movers.data() + gathered);
+			gathered += m_teamSlots[t].movers;
+		}
+		uint64_t* moved = m_movers.data();
+		std::sort(moved, moved + movers);
+
+		// Removal and insertion events as cell << 1 | inserted, movers are marked so the merge skips their old place
+		uint64_t* events = m_cellEvents.data();
+		uint32_t lowest = std::numeric_limits<uint32_t>::max(), highest = 0;
+		for (size_t m = 0; m < movers; ++m) {
+			uint32_t to = static_cast<uint32_t>(moved[m] >> 32);
+			uint32_t index = static_cast<uint32_t>(moved[m]);
+			uint32_t from = m_particleCell[index];
+			events[2 * m] = static_cast<uint64_t>(from) << 1;
+			events[2 * m + 1] = (static_cast<uint64_t>(to) << 1) | 1;
+			lowest = std::min(lowest, std::min(from, to));
+			highest = std::max(highest, std::max(from, to));
+			m_particleCell[index] = MovedMark;
+		}
+		std::sort(events, events + 2 * movers);
+
+		// Merge the span's staying particles, already in (cell, index) order, with the sorted movers
+		const uint32_t first = m_cellStart[lowest], last = m_cellEnd[highest];
+		m_cellScratch.assign(m_cellParticles.begin() + first, m_cellParticles.begin() + last);
+		uint32_t* out = m_cellParticles.data() + first;
+		size_t m = 0;
+		for (uint32_t index : m_cellScratch) {
+			if (m_particleCell[index] == MovedMark) {
+				continue;
+			}
+			uint64_t key = (static_cast<uint64_t>(m_particleCell[index]) << 32) | index;
+			for (; m < movers && moved[m] < key; ++m) {
+				*out++ = static_cast<uint32_t>(moved[m]);
+			}
+			*out++ = index;
+		}
+		for (; m < movers; ++m) {
+			*out++ = static_cast<uint32_t>(moved[m]);
+		}
+		for (size_t k = 0; k < movers; ++k) {
+			m_particleCell[static_cast<uint32_t>(moved[k])] = static_cast<uint32_t>(moved[k] >> 32);
+		}
+
+		// Shift the cell offsets by the net insertions before each cell
+		uint32_t delta = 0; // Modular, so negative shifts wrap back into range
+		for (size_t e = 0; e < 2 * movers;) {
+			uint32_t cell = static_cast<uint32_t>(events[e] >> 1);
+			m_cellStart[cell] += delta;
+			for (; e < 2 * movers && static_cast<uint32_t>(events[e] >> 1) == cell; ++e) {
+				delta += (events[e] & 1) ? 1u : static_cast<uint32_t>(-1);
+			}
+			m_cellEnd[cell] += delta;
+			uint32_t next = e < 2 * movers ? static_cast<uint32_t>(events[e] >> 1) : cell + 1;
+			if (delta != 0) {
+				for (uint32_t c = cell + 1; c < next; ++c) {
+					m_cellStart[c] += delta;
+					m_cellEnd[c] += delta;
+				}
+			}
+		}
+	}
+
+	// Counting sort of the particles into grid cells, on the whole team for large scenes
+	void sortIntoCells() {
+		if (size() >= ParallelSortMinParticles && omp_get_num_threads() >= ParallelSortMinThreads) {
+			sortIntoCellsParallel();
+			return;
+		}
+
+		#pragma omp single
+		{
+			// Count the particles in each cell
+			std::fill(m_cellEnd.begin(), m_cellEnd.end(), 0);
+			for (size_t i = 0; i < size(); ++i) {
+				m_particleCell[i] = computeGridIndex(m_x[i], m_y[i]);
+				m_cellEnd[m_particleCell[i]]++;
+			}
+
+			// Exclusive prefix sum gives where each cell starts
+			uint32_t offset = 0;
+			for (size_t c = 0; c < m_cellStart.size(); ++c) {
+				m_cellStart[c] = offset;
+				offset += m_cellEnd[c];
+				m_cellEnd[c] = m_cellStart[c];
+			}
+
+			// Scatter particle indices, m_cellEnd is the insertion point until the cell is full
+			for (size_t i = 0; i < size(); ++i) {
+				m_cellParticles[m_cellEnd[m_particleCell[i]]++] = static_cast<uint32_t>(i);
+			}
+		}
+	}
+
+	// Parallel counting sort, each cell is put back in index order afterwards so the result matches the serial sort
+	void sortIntoCellsParallel() {
+		const size_t n = size();
+		const size_t cells = m_cellStart.size();
+		uint32_t* cellStart = m_cellStart.data();
+		uint32_t* cellEnd = m_cellEnd.data();
+		uint32_t* particleCell = m_particleCell.data();
+		uint32_t* cellParticles = m_cellParticles.data();
+
+		const size_t thread = static_cast<size_t>(omp_get_thread_num());
+		const size_t threads = static_cast<size_t>(omp_get_num_threads());
+
+		// Count the particles in each cell
+		#pragma omp for
+		for (size_t c = 0; c < cells; ++c) {
+			cellEnd[c] = 0;
+		}
+		#pragma omp for
+		for (size_t i = 0; i < n; ++i) {
+			uint32_t cell = static_cast<uint32_t>(computeGridIndex(m_x[i], m_y[i]));
+			particleCell[i] = cell;
+			#pragma omp atomic
+			cellEnd[cell]++;
+		}
+
+		// Blocked exclusive prefix sum, m_cellEnd becomes the insertion point as in the serial sort
+		#pragma omp single
+		m_blockOffsets.resize(threads + 1);
+		const size_t first = cells * thread / threads, last = cells * (thread + 1) / threads;
+		uint32_t total = 0;
+		for (size_t c = first; c < last; ++c) {
+			total += cellEnd[c];
+		}
+		m_blockOffsets[thread + 1] = total;
+		#pragma omp barrier
+		#pragma omp single
+		{
+			m_blockOffsets[0] = 0;
+			for (size_t t = 0; t < threads; ++t) {
+				m_blockOffsets[t + 1] += m_blockOffsets[t];
+			}
+		}
+		uint32_t offset = m_blockOffsets[thread];
+		for (size_t c = first; c < last; ++c) {
+			cellStart[c] = offset;
+			offset += cellEnd[c];
+			cellEnd[c] = cellStart[c];
+		}
+		#pragma omp barrier
+
+		// Scatter particle indices
+		#pragma omp for
+		for (size_t i = 0; i < n; ++i) {
+			uint32_t slot;
+			#pragma omp atomic capture
+			slot = cellEnd[particleCell[i]]++;
+			cellParticles[slot] = static_cast<uint32_t>(i);
+		}
+
+		// Restore index order within each cell, cells hold a handful of particles so insertion sort it is
+		#pragma omp for
+		for (size_t c = 0; c < cells; ++c) {
+			for (uint32_t k = cellStart[c] + 1; k < cellEnd[c]; ++k) {
+				uint32_t index = cellParticles[k];
+				uint32_t j = k;
+				for (; j > cellStart[c] && cellParticles[j - 1] > index; --j) {
+					cellParticles[j] = cellParticles[j - 1];
+				}
+				cellParticles[j] = index;
+			}
+		}
+	}
+
+	// Builds the Verlet lists from the grid as compressed rows: particle i's neighbors (itself included) are
+	// m_neighborList[m_neighborStart[i], m_neighborStart[i + 1]). In symmetric mode each pair is listed once,
+	// under whichever particle comes first in the half stencil
+	void buildNeighborLists() {
+		const Scalar cutoff = m_params.h + m_params.neighborSkin;
+		const Scalar cutoff2 = cutoff * cutoff;
+		const size_t n = size();
+		#pragma omp single
+		{
+			m_neighborStart.resize(n + 1);
+			m_listX.resize(n);
+			m_listY.resize(n);
+		}
+
+		// Count the neighbors of each particle
+		#pragma omp for
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = m_cellParticles[k];
+			Scalar xi = m_x[i], yi = m_y[i];
+			uint32_t count = 0;
+			forEachListCandidate(k, [&](size_t j) {
+				Scalar rx = m_x[j] - xi;
+				Scalar ry = m_y[j] - yi;
+				if (rx * rx + ry * ry < cutoff2) count++;
+			});
+			m_neighborStart[i + 1] = count;
+			m_listX[i] = xi;
+			m_listY[i] = yi;
+		}
+
+		#pragma omp single
+		{
+			m_neighborStart[0] = 0;
+			for (size_t i = 0; i < n; ++i) {
+				m_neighborStart[i + 1] += m_neighborStart[i];
+			}
+
+			// Grow with headroom so that rebuilds in a compressing fluid don't allocate every time
+			size_t total = m_neighborStart[n];
+			if (m_neighborList.capacity() < total) {
+				m_neighborList.reserve(total + total / 2);
+				m_neighborListGrowths++;
+			}
+			m_neighborList.resize(total);
+		}
+
+		// Fill the lists
+		#pragma omp for
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = m_cellParticles[k];
+			Scalar xi = m_x[i], yi = m_y[i];
+			uint32_t next = m_neighborStart[i];
+			forEachListCandidate(k, [&](size_t j) {
+				Scalar rx = m_x[j] - xi;
+				Scalar ry = m_y[j] - yi;
+				if (rx * rx + ry * ry < cutoff2) m_neighborList[next++] = static_cast<uint32_t>(j);
+			});
+		}
+
+		#pragma omp single
+		{
+			m_neighborListsValid = true;
+			m_neighborListBuilds++;
+		}
+	}
+
+	// Sorts the particles along a Z-order (Morton) curve over their grid cells, so particles that are close in
+	// space are close in memory. Particle ids move with their particles
+	void reorderParticles() {
+		#pragma omp single
+		{
+			resizeGrid();
+			m_sortKeys.resize(size());
+		}
+		#pragma omp for
+		for (size_t i = 0; i < size(); ++i) {
+			int x, y;
+			computeGridCoords(m_x[i], m_y[i], x, y);
+			uint64_t morton = interleaveBits(static_cast<uint32_t>(x)) | (interleaveBits(static_cast<uint32_t>(y)) << 1);
+			m_sortKeys[i] = (morton << 32) | i; // Ties keep their current order
+		}
+		#pragma omp single
+		std::sort(m_sortKeys.begin(), m_sortKeys.end());
+
+		permute(m_x, m_scratch);
+		permute(m_y, m_scratch);
+		permute(m_vx, m_scratch);
+		permute(m_vy, m_scratch);
+		permute(m_fx, m_scratch);
+		permute(m_fy, m_scratch);
+		permute(m_rho, m_scratch);
+		permute(m_p, m_scratch);
+		permute(m_ids, m_scratchIds);
+		#pragma omp single
+		{
+			m_neighborListsValid = false;
+			m_cellsCurrent = false;
+		}
+	}
+
+	// Reorders particles every interval steps, 0 disables reordering
+	void setReorderInterval(size_t interval) { m_reorderInterval = interval; }
+	size_t getReorderInterval() { return m_reorderInterval; }
+
+	// Number of completed Integrate steps
+	size_t getStepCount() { return m_stepCount; }
+
+	// Calls visit(begin, end) for each run of candidate neighbor indices around a position, without touching the heap.
+	// Cells in a grid row are adjacent in m_cellParticles, so each row of the 3x3 stencil is a single run
+	template<typename Visitor>
+	void forEachNeighborSpan(Scalar px, Scalar py, Visitor&& visit) {
+		if (m_hashGrid) {
+			forEachHashedNeighborSpan(px, py, visit);
+			return;
+		}
+
+		int x, y;
+		computeGridCoords(px, py, x, y);
+		int x0 = x > 0 ? x - 1 : 0;
+		int x1 = x < m_gridWidth - 1 ? x + 1 : m_gridWidth - 1;
+		int y0 = y > 0 ? y - 1 : 0;
+		int y1 = y < m_gridHeight - 1 ? y + 1 : m_gridHeight - 1;
+
+		for (int cy = y0; cy <= y1; ++cy) {
+			uint32_t begin = m_cellStart[cy * m_gridWidth + x0];
+			uint32_t end = m_cellEnd[cy * m_gridWidth + x1];
+			if (begin != end) {
+				visit(m_cellParticles.data() + begin, m_cellParticles.data() + end);
+			}
+		}
+	}
+
+	// Hash grid counterpart of forEachNeighborSpan. The nine stencil slots are sorted and a slot two cells share is
+	// visited once. Their particles are scattered over m_cellParticles in short runs, so they're gathered into one
+	// buffer and visited together, which keeps the SIMD kernels working on full vectors
+	template<typename Visitor>
+	void forEachHashedNeighborSpan(Scalar px, Scalar py, Visitor&& visit) {
+		int x, y;
+		computeGridCoords(px, py, x, y);
+		uint64_t mortonX[3], mortonY[3];
+		for (int d = 0; d < 3; ++d) {
+			mortonX[d] = interleaveBits32(static_cast<uint32_t>(x + d - 1));
+			mortonY[d] = interleaveBits32(static_cast<uint32_t>(y + d - 1)) << 1;
+		}
+
+		uint32_t slots[9];
+		int count = 0;
+		for (int dy = 0; dy < 3; ++dy) {
+			for (int dx = 0; dx < 3; ++dx) {
+				uint32_t slot = hashMorton(mortonX[dx] | mortonY[dy]);
+				int k = count++;
+				for (; k > 0 && slots[k - 1] > slot; --k) {
+					slots[k] = slots[k - 1];
+				}
+				slots[k] = slot;
+			}
+		}
+
+		uint32_t gathered[HashGatherSize];
+		size_t gatheredCount = 0;
+		for (int k = 0; k < 9; ++k) {
+			if (k > 0 && slots[k] == slots[k - 1]) {
+				continue;
+			}
+			const uint32_t* it = m_cellParticles.data() + m_cellStart[slots[k]];
+			const uint32_t* end = m_cellParticles.data() + m_cellEnd[slots[k]];
+			for (; it != end; ++it) {
+				if (gatheredCount == HashGatherSize) {
+					visit(gathered, gathered + gatheredCount);
+					gatheredCount = 0;
+				}
+				gathered[gatheredCount++] = *it;
+			}
+		}
+		if (gatheredCount > 0) {
+			visit(gathered, gathered + gatheredCount);
+		}
+	}
+
+	// Calls visit(j) for every candidate neighbor j of a position (every particle in the 3x3 cell stencil)
+	template<typename Visitor>
+	void forEachNeighbor(Scalar px, Scalar py, Visitor&& visit) {
+		forEachNeighborSpan(px, py, [&](const uint32_t* begin, const uint32_t* end) {
+			for (const uint32_t* it = begin; it != end; ++it) {
+				visit(static_cast<size_t>(*it));
+			}
+		});
+	}
+
+	// Calls visit(begin, end) for the forward half of the 3x3 stencil around the particle at position k of
+	// m_cellParticles: the rest of its own cell, the cell to its right and the three cells in the row above.
+	// Every pair of particles in neighboring cells is visited from exactly one side
+	template<typename Visitor>
+	void forEachHalfStencilSpan(size_t k, Visitor&& visit) {
+		int c = m_particleCell[m_cellParticles[k]];
+		int x = c % m_gridWidth, y = c / m_gridWidth;
+		const uint32_t* particles = m_cellParticles.data();
+
+		// The own cell and the one to its right are adjacent in m_cellParticles
+		uint32_t rowEnd = x + 1 < m_gridWidth ? m_cellEnd[c + 1] : m_cellEnd[c];
+		if (k + 1 < rowEnd) {
+			visit(particles + k + 1, particles + rowEnd);
+		}
+
+		if (y + 1 < m_gridHeight) {
+			int x0 = x > 0 ? x - 1 : 0;
+			int x1 = x < m_gridWidth - 1 ? x + 1 : m_gridWidth - 1;
+			uint32_t begin = m_cellStart[(y + 1) * m_gridWidth + x0];
+			uint32_t end = m_cellEnd[(y + 1) * m_gridWidth + x1];
+			if (begin != end) {
+				visit(particles + begin, particles + end);
+			}
 		}
 	}
 
-	// Returns a vector of neighbors for a given position
-	std::vector<int> getNeighborCells(const Eigen::Vector2d& pos) {
-		int x = static_cast<int>(pos(0) / H);
-		int y = static_cast<int>(pos(1) / H);
-		std::vector<int> neighbors;
+	// Half-stencil counterpart of forEachNeighborSpan for the particle at position k of m_cellParticles:
+	// its cached half list when neighbor lists are on, otherwise the forward half of the cell stencil
+	template<typename Visitor>
+	void forEachHalfNeighborSpan(size_t k, Visitor&& visit) {
+		if (m_useNeighborLists) {
+			size_t i = m_cellParticles[k];
+			visit(m_neighborList.data() + m_neighborStart[i], m_neighborList.data() + m_neighborStart[i + 1]);
+		}
+		else {
+			forEachHalfStencilSpan(k, visit);
+		}
+	}
 
-		for (int dx = -1; dx <= 1; ++dx) {
-			for (int dy = -1; dy <= 1; ++dy) {
-				neighbors.push_back(computeGridIndex(Eigen::Vector2d((x + dx) * H, (y + dy) * H)));
+	template<typename Visitor>
+	void forEachHalfNeighbor(size_t k, Visitor&& visit) {
+		forEachHalfNeighborSpan(k, [&](const uint32_t* begin, const uint32_t* end) {
+			for (const uint32_t* it = begin; it != end; ++it) {
+				visit(static_cast<size_t>(*it));
 			}
+		});
+	}
+
+	// Runs body(c, counts) for every grid cell, one color at a time, with the cells of a color in parallel. Cells are
+	// colored by (column % 3, row % 2), so same-colored cells are at least 3 columns or 2 rows apart and the particles
+	// their half stencils write to never overlap. counts is the calling thread's, for the step stats
+	template<typename Body>
+	void forEachCellColored(Body&& body) {
+		#pragma omp parallel
+		{
+			for (int color = 0; color < 6; ++color) {
+				int x0 = color % 3, y0 = color / 3;
+				int columns = (m_gridWidth - x0 + 2) / 3;
+				int rows = (m_gridHeight - y0 + 1) / 2;
+
+				NeighborCounts counts;
+				double start = omp_get_wtime();
+				#pragma omp for schedule(dynamic, 16) nowait
+				for (int n = 0; n < columns * rows; ++n) {
+					int cx = x0 + 3 * (n % columns);
+					int cy = y0 + 2 * (n / columns);
+					body(cy * m_gridWidth + cx, counts);
+				}
+				m_stats.recordThread(omp_get_thread_num(), start, omp_get_wtime(), counts, color);
+
+				// The next color may write to this color's neighbors
+				#pragma omp barrier
+			}
+		}
+	}
+
+	// Evaluates each interacting pair once and applies the result to both particles, instead of once from each side
+	void setUseSymmetricPairs(bool use) {
+		m_useSymmetricPairs = use;
+		m_neighborListsValid = false;
+	}
+	bool getUseSymmetricPairs() { return m_useSymmetricPairs; }
+
+	// True when the symmetric pair passes actually run, they need the dense grid
+	bool symmetricPairsActive() { return m_useSymmetricPairs && !m_hashGrid; }
+
+	// Candidate neighbors of particle i: its cached Verlet list when neighbor lists are on, otherwise the cell stencil
+	template<typename Visitor>
+	void forEachNeighborSpan(size_t i, Visitor&& visit) {
+		if (m_useNeighborLists) {
+			visit(m_neighborList.data() + m_neighborStart[i], m_neighborList.data() + m_neighborStart[i + 1]);
 		}
-		return neighbors;
+		else {
+			forEachNeighborSpan(m_x[i], m_y[i], visit);
+		}
+	}
+
+	template<typename Visitor>
+	void forEachNeighbor(size_t i, Visitor&& visit) {
+		forEachNeighborSpan(i, [&](const uint32_t* begin, const uint32_t* end) {
+			for (const uint32_t* it = begin; it != end; ++it) {
+				visit(static_cast<size_t>(*it));
+			}
+		});
 	}
 
+	// Grid dimensions in cells and the counting sort output
+	int getGridWidth() { return m_gridWidth; }
+	int getGridHeight() { return m_gridHeight; }
+	const uint32_t* cellStart() { return m_cellStart.data(); }
+	const uint32_t* cellEnd() { return m_cellEnd.data(); }
+	const uint32_t* cellParticles() { return m_cellParticles.data(); }
+
 	// Applies mouse drag to particles by adding force to them
 	void applyMouseDragForce(double mouseX, double mouseY, const Eigen::Vector2d& force)
 	{
@@ -79,165 +733,1001 @@ public:
 		// Mouse x values go from 0 to WINDOW_WIDTH
 		// Have to convert between the two for accurate results
 		// Same goes for y values
-		double worldMouseX = static_cast<float>(BOUNDARY + (mouseX / (WINDOW_WIDTH / 2.0f)) * (VIEW_WIDTH - 2.0f * BOUNDARY));
-		double worldMouseY = static_cast<float>(BOUNDARY + (mouseY / (WINDOW_HEIGHT / 2.0f)) * (VIEW_HEIGHT - 2.0f * BOUNDARY));
+		double worldMouseX = static_cast<float>(m_params.boundary + (mouseX / (WINDOW_WIDTH / 2.0f)) * (m_viewWidth - 2.0f * m_params.boundary));
+		double worldMouseY = static_cast<float>(m_params.boundary + (mouseY / (WINDOW_HEIGHT / 2.0f)) * (m_viewHeight - 2.0f * m_params.boundary));
 
-		for (auto& p : m_particles)
+		for (size_t i = 0; i < size(); ++i)
 		{
 			// Compute distance from mouse to particle
-			Eigen::Vector2d diff = p.getPosition() - Eigen::Vector2d(worldMouseX, worldMouseY);
+			Eigen::Vector2d diff = Eigen::Vector2d(m_x[i], m_y[i]) - Eigen::Vector2d(worldMouseX, worldMouseY);
 			float distance = diff.norm();
 
 			// Apply force if within a certain radius
-			if (distance < 2 * H) // Adjust radius as needed, using 2 * H here
+			if (distance < 2 * m_params.h) // Adjust radius as needed, using 2h here
 			{
-				p.setForce(p.getForce() + force);
+				m_fx[i] += force(0);
+				m_fy[i] += force(1);
 			}
 		}
 	}
 
 	// Constructor
-	ParticleList(){}
+	BasicParticleList(){}
+
+	// Size of the simulated domain, defaults to the window's view
+	double getViewWidth() { return m_viewWidth; }
+	double getViewHeight() { return m_viewHeight; }
+	void setView(double width, double height) {
+		m_viewWidth = width;
+		m_viewHeight = height;
+		m_neighborListsValid = false;
+	}
+
+	// Open boundary: the view has no walls, and Integrate lets particles leave it instead of clamping them back.
+	// Only the hash grid covers the space outside the view (the dense grid would pile everything there into its
+	// edge cells), so it only takes effect together with the hash grid
+	void setOpenBoundary(bool open) { m_openBoundary = open; }
+	bool getOpenBoundary() { return m_openBoundary; }
+
+	// True when Integrate skips the wall clamp
+	bool openBoundaryActive() const { return m_openBoundary && m_hashGrid; }
 
 	// Getters/Setters
-	std::vector<Particle> getParticles() { return m_particles; }
-	void setParticles(std::vector<Particle> particles) { m_particles = particles; }
-	std::vector<float> getParticlePositions() {
-		std::vector<float> positions;
-		for (auto& pi : m_particles) {
-			positions.push_back(pi.getPosition()(0));
-			positions.push_back(pi.getPosition()(1));
+	// Particle-style view of a single particle, kept for compatibility with code written against Particle
+	ParticleType getParticle(size_t i) {
+		ParticleType p(0.0f, 0.0f);
+		p.setPosition(Vector2(m_x[i], m_y[i]));
+		p.setVelocity(Vector2(m_vx[i], m_vy[i]));
+		p.setForce(Vector2(m_fx[i], m_fy[i]));
+		p.setRho(m_rho[i]);
+		p.setP(m_p[i]);
+		return p;
+	}
+	void setParticle(size_t i, ParticleType p) {
+		m_x[i] = p.getPosition()(0);
+		m_y[i] = p.getPosition()(1);
+		m_vx[i] = p.getVelocity()(0);
+		m_vy[i] = p.getVelocity()(1);
+		m_fx[i] = p.getForce()(0);
+		m_fy[i] = p.getForce()(1);
+		m_rho[i] = p.getRho();
+		m_p[i] = p.getP();
+		m_neighborListsValid = false;
+	}
+	std::vector<ParticleType> getParticles() {
+		std::vector<ParticleType> particles;
+		particles.reserve(size());
+		for (size_t i = 0; i < size(); ++i) {
+			particles.push_back(getParticle(i));
+		}
+		return particles;
+	}
+	void setParticles(std::vector<ParticleType> particles) {
+		clearParticles();
+		for (auto& p : particles) {
+			addParticle(p);
 		}
+	}
+	std::vector<float> getParticlePositions() {
+		std::vector<float> positions(2 * size());
+		exportPositions(positions.data());
 		return positions;
 	}
 
+	// Writes the positions as interleaved x, y floats (the vertex layout the renderer draws) straight into out,
+	// which must hold 2 * size() floats. Runs in parallel and doesn't allocate, unlike getParticlePositions
+	void exportPositions(float* out) {
+		StepStats::ScopedPhase timer(m_stats, SolverPhase::Export);
+		const Scalar* x = m_x.data();
+		const Scalar* y = m_y.data();
+
+		forEachParticleParallel([&](size_t i, NeighborCounts&) {
+			out[2 * i] = static_cast<float>(x[i]);
+			out[2 * i + 1] = static_cast<float>(y[i]);
+		});
+	}
+
 	// Clear all particles
-	void clearParticles() { m_particles.clear(); }
+	void clearParticles() {
+		m_x.clear(); m_y.clear();
+		m_vx.clear(); m_vy.clear();
+		m_fx.clear(); m_fy.clear();
+		m_rho.clear(); m_p.clear();
+		m_ids.clear();
+		m_nextId = 0;
+		m_neighborListsValid = false;
+	}
 
 	// Add a particle to the list
-	void addParticle(Particle p) { m_particles.push_back(p); }
+	void addParticle(ParticleType p) {
+		m_x.push_back(0.0); m_y.push_back(0.0);
+		m_vx.push_back(0.0); m_vy.push_back(0.0);
+		m_fx.push_back(0.0); m_fy.push_back(0.0);
+		m_rho.push_back(0.0f); m_p.push_back(0.0f);
+		m_ids.push_back(m_nextId++);
+		setParticle(size() - 1, p);
+	}
+
+	// Sets the particle count for filling the raw field arrays directly, e.g. from a checkpoint. Particles past the
+	// old count start out zeroed with fresh ids
+	void resizeParticles(size_t count) {
+		size_t old = size();
+		m_x.resize(count); m_y.resize(count);
+		m_vx.resize(count); m_vy.resize(count);
+		m_fx.resize(count); m_fy.resize(count);
+		m_rho.resize(count); m_p.resize(count);
+		m_ids.resize(count);
+		for (size_t i = old; i < count; ++i) {
+			m_ids[i] = m_nextId++;
+		}
+		m_neighborListsValid = false;
+		m_cellsCurrent = false;
+	}
 
 	// Returns the number of particles
-	size_t size() { return m_particles.size(); }
+	size_t size() { return m_x.size(); }
+
+	// Raw field arrays, each size() long
+	Scalar* positionsX() { return m_x.data(); }
+	Scalar* positionsY() { return m_y.data(); }
+	Scalar* velocitiesX() { return m_vx.data(); }
+	Scalar* velocitiesY() { return m_vy.data(); }
+	Scalar* forcesX() { return m_fx.data(); }
+	Scalar* forcesY() { return m_fy.data(); }
+	Scalar* densities() { return m_rho.data(); }
+	Scalar* pressures() { return m_p.data(); }
 
-	// Returns particle data
-	Particle* data() { return m_particles.data(); }
+	// Stable particle ids: the id given to a particle when it was added, which follows it through reordering
+	const uint32_t* particleIds() { return m_ids.data(); }
+	uint32_t getParticleId(size_t i) { return m_ids[i]; }
+	void setParticleIds(const uint32_t* ids) {
+		std::copy(ids, ids + size(), m_ids.begin());
+	}
+
+	// Solver state besides the particle fields, all a checkpoint needs to carry a run on where it stopped
+	struct RunState {
+		size_t stepCount = 0;
+		size_t nextReorderStep = 0;
+		double simulatedTime = 0.0;
+		Scalar dt = C::DT;
+		uint32_t nextId = 0;
+	};
+	RunState getRunState() {
+		RunState state;
+		state.stepCount = m_stepCount;
+		state.nextReorderStep = m_nextReorderStep;
+		state.simulatedTime = m_simulatedTime;
+		state.dt = m_dt;
+		state.nextId = m_nextId;
+		return state;
+	}
+	void setRunState(const RunState& state) {
+		m_stepCount = state.stepCount;
+		m_nextReorderStep = state.nextReorderStep;
+		m_simulatedTime = state.simulatedTime;
+		m_dt = state.dt;
+		m_nextId = state.nextId;
+	}
 
 	// Calculates densities using OpenMP for parallelism
 	void calculateDensities()
 	{
-		#pragma omp parallel for
-		for (size_t i = 0; i < m_particles.size(); ++i)
-		{
-			auto& pi = m_particles[i];
-			pi.setRho(0.0f);
-
-			// Get neighboring cells
-			std::vector<int> neighborCells = getNeighborCells(pi.getPosition());
-
-			// Iterate over neighbors
-			for (int cellIndex : neighborCells) {
-				auto it = grid.find(cellIndex);
-				if (it == grid.end()) continue; // Skip empty cells
-				for (size_t j : grid[cellIndex].particleIndices)
-				{
-					Eigen::Vector2d rij = m_particles[j].getPosition() - pi.getPosition();
-					float r2 = rij.squaredNorm();
+		StepStats::ScopedPhase timer(m_stats, SolverPhase::Densities);
+		if (symmetricPairsActive()) {
+			calculateDensitiesSymmetric();
+			return;
+		}
 
-					if (r2 < HSQ) { // Use squared distance for efficiency
-						pi.setRho(pi.getRho() + MASS * W_POLY6 * pow(HSQ - r2, 3.0f));
-					}
-				}
-			}
-			pi.setP(GAS_CONST * (pi.getRho() - REST_DENS)); // Equation 12
+		switch (m_simdIsa) {
+#if FLUIDSIM_X86_SIMD
+		case SimdIsa::AVX512: calculateDensitiesWith<SimdIsa::AVX512>(); break;
+		case SimdIsa::AVX2: calculateDensitiesWith<SimdIsa::AVX2>(); break;
+#endif
+		default: calculateDensitiesWith<SimdIsa::Scalar>(); break;
 		}
 	}
 	
 	// Calculates forces using OpenMP for parallelism
 	void calculateForces()
 	{
-		#pragma omp parallel for
-		for (size_t i = 0; i < m_particles.size(); ++i)
+		StepStats::ScopedPhase timer(m_stats, SolverPhase::Forces);
+		if (symmetricPairsActive()) {
+			calculateForcesSymmetric();
+			return;
+		}
+
+		switch (m_simdIsa) {
+#if FLUIDSIM_X86_SIMD
+		case SimdIsa::AVX512: calculateForcesWith<SimdIsa::AVX512>(); break;
+		case SimdIsa::AVX2: calculateForcesWith<SimdIsa::AVX2>(); break;
+#endif
+		default: calculateForcesWith<SimdIsa::Scalar>(); break;
+		}
+	}
+
+	// Instruction set used by the density and force kernels, defaults to the widest one the CPU supports.
+	// Returns false (and keeps the current one) if the CPU can't run the requested set.
+	// The symmetric pair kernels scatter into neighbors and always run scalar
+	bool setSimdIsa(SimdIsa isa) {
+		if (!simdIsaSupported(isa)) {
+			return false;
+		}
+		m_simdIsa = isa;
+		return true;
+	}
+	SimdIsa getSimdIsa() { return m_simdIsa; }
+	// The instruction set the density and force passes actually run with: scalar for the symmetric pair kernels and
+	// for kernel families without vectorized loops (see SimdKernels.h)
+	SimdIsa getActiveSimdIsa() { return symmetricPairsActive() ? SimdIsa::Scalar : kernelSimdIsa<Scalar>(m_simdIsa); }
+
+	// Splits the density and force passes by neighbor cost with work stealing (see BalancedSchedule.h). On by default
+	void setBalancedSchedule(bool balanced) { m_balancedSchedule = balanced; }
+	bool getBalancedSchedule() { return m_balancedSchedule; }
+
+	// SPH parameters the solver runs with, SphConstants unless a scene changed them. Setting them recomputes the
+	// derived values, resets the fixed dt and makes the neighbor lists and grid rebuild, as h may have changed
+	const SphParameters<Scalar>& getParameters() { return m_params; }
+	void setParameters(const SphParameters<Scalar>& params) {
+		m_params = params;
+		m_params.update();
+		m_dt = m_params.dt;
+		m_neighborListsValid = false;
+		m_cellsCurrent = false;
+	}
+
+	// Adaptive time stepping: instead of the fixed DT, every step takes the largest dt the CFL, force and viscosity
+	// criteria allow (see Constants.h), so violent flow gets smaller steps than DT
+	void setAdaptiveTimeStep(bool adaptive) {
+		m_adaptiveTimeStep = adaptive;
+		m_dt = m_params.dt;
+	}
+	bool getAdaptiveTimeStep() { return m_adaptiveTimeStep; }
+
+	// dt the next Integrate uses, and the simulated time integrated so far
+	Scalar getTimeStep() { return m_dt; }
+	double getSimulatedTime() { return m_simulatedTime; }
+
+	// Picks the dt of the coming Integrate from the current velocities, forces and densities, so call it after
+	// calculateForces. The step never goes past remaining, and when remaining is less than two steps it is split
+	// evenly so the last step isn't a sliver. Returns the chosen dt
+	Scalar chooseTimeStep(Scalar remaining = std::numeric_limits<Scalar>::max()) {
+		m_dt = clipTimeStep(m_adaptiveTimeStep ? stableTimeStep() : m_params.dt, remaining);
+		return m_dt;
+	}
+
+	// Advances the simulation by duration simulated seconds, in as many steps as the time step needs but at most
+	// maxSteps. Returns the number of steps taken
+	size_t advance(Scalar duration, size_t maxSteps = 1000) {
+		size_t steps = 0;
+		Scalar remaining = duration;
+		while (remaining > 0 && steps < maxSteps) {
+			remaining -= step(remaining);
+			steps++;
+		}
+		return steps;
+	}
+
+	// Runs one whole solver step in a single parallel region with spin barriers between the phases.
+	// dt is clipped to remaining as in chooseTimeStep. Returns the dt the step integrated over
+	Scalar step(Scalar remaining = std::numeric_limits<Scalar>::max()) {
+		if (symmetricPairsActive()) {
+			buildGrid();
+			calculateDensities();
+			calculateForces();
+			Scalar dt = chooseTimeStep(remaining);
+			Integrate();
+			return dt;
+		}
+
+		switch (m_simdIsa) {
+#if FLUIDSIM_X86_SIMD
+		case SimdIsa::AVX512: return stepFused<SimdIsa::AVX512>(remaining);
+		case SimdIsa::AVX2: return stepFused<SimdIsa::AVX2>(remaining);
+#endif
+		default: return stepFused<SimdIsa::Scalar>(remaining);
+		}
+	}
+
+	// Integrating using Euler's method with OpenMP for parallelism, over the dt chooseTimeStep picked (DT by default)
+	void Integrate()
+	{
+		StepStats::ScopedPhase timer(m_stats, SolverPhase::Integrate);
+		const Scalar dt = m_dt;
+		forEachParticleParallel([&](size_t i, NeighborCounts&) {
+			integrateParticle(i, dt);
+		});
+		finishStep(dt);
+	}
+
+	// Timings and counters of the solver phases, see StepStats.h
+	StepStats& getStats() { return m_stats; }
+private:
+	// Density pass with the neighbor sums done by the given instruction set
+	template<SimdIsa Isa>
+	void calculateDensitiesWith()
+	{
+		forEachParticleBalanced(DensityPass, [&](size_t i, NeighborCounts& counts) {
+			return computeDensity<Isa>(i, counts);
+		});
+	}
+
+	// Force pass with the neighbor sums done by the given instruction set
+	template<SimdIsa Isa>
+	void calculateForcesWith()
+	{
+		forEachParticleBalanced(ForcePass, [&](size_t i, NeighborCounts&) {
+			return computeForce<Isa>(i);
+		});
+	}
+
+	// The calling thread's part of a balanced pass, body(k) for the grid positions k of its blocks
+	template<typename Body>
+	void runBalanced(int thread, int pass, Body&& body) {
+		const bool traced = m_stats.isTracing();
+		m_schedule.run(thread, pass, [&](size_t begin, size_t end, size_t block, bool stolen) {
+			double start = traced ? omp_get_wtime() : 0.0;
+			uint64_t cost = 0;
+			for (size_t k = begin; k < end; ++k) {
+				cost += ParticleBaseCost + body(k);
+			}
+			if (traced) {
+				m_stats.recordBlock(thread, start, omp_get_wtime(), block, stolen);
+			}
+			return cost;
+		});
+	}
+
+	// forEachParticleParallel on the balanced schedule when it's on, body returns the particle's neighbor candidates
+	template<typename Body>
+	void forEachParticleBalanced(int pass, Body&& body) {
+		if (!m_balancedSchedule) {
+			forEachParticleParallel([&](size_t i, NeighborCounts& counts) { body(i, counts); });
+			return;
+		}
+
+		const uint32_t* order = m_cellParticles.data();
+		#pragma omp parallel
 		{
-			auto& pi = m_particles[i];
-			Eigen::Vector2d pressure(0.f, 0.f);
-			Eigen::Vector2d viscosity(0.f, 0.f);
+			// Planned for the team that runs it, which may be smaller than omp_get_max_threads()
+			#pragma omp single
+			{
+				m_schedule.setup(size(), omp_get_num_threads());
+				m_schedule.partition();
+			}
+			NeighborCounts counts;
+			int thread = omp_get_thread_num();
+			double start = omp_get_wtime();
+			runBalanced(thread, pass, [&](size_t k) { return body(order[k], counts); });
+			m_stats.recordThread(thread, start, omp_get_wtime(), counts);
+		}
+	}
 
-			// Get neighboring cells
-			std::vector<int> neighborCells = getNeighborCells(pi.getPosition());
+	// Density and pressure of particle i, returns the neighbor candidates it tested
+	template<SimdIsa Isa>
+	size_t computeDensity(size_t i, NeighborCounts& counts)
+	{
+		const Scalar* x = m_x.data();
+		const Scalar* y = m_y.data();
+		Scalar xi = x[i], yi = y[i];
+		Scalar sum = 0.0;
+		size_t candidates = 0;
 
-			for (int cellIndex : neighborCells) {
-				auto it = grid.find(cellIndex);
-				if (it == grid.end()) continue; // Skip empty cells
+		// Iterate over neighbors
+		forEachNeighborSpan(i, [&](const uint32_t* begin, const uint32_t* end) {
+			candidates += end - begin;
+			sum += SphKernels<Isa, Scalar>::density(xi, yi, begin, end - begin, x, y, m_params, counts.accepted);
+		});
+		counts.tested += candidates;
+		Scalar rho = m_params.mass * m_params.wDensity * sum;
+		m_rho[i] = rho;
+		m_p[i] = m_params.gasConstant * (rho - m_params.restDensity); // Equation 12
+		return candidates;
+	}
 
-				for (size_t j : it->second.particleIndices)
-				{
-					if (i == j) continue;
+	// Pressure, viscosity and gravity force on particle i, returns the neighbor candidates it tested
+	template<SimdIsa Isa>
+	size_t computeForce(size_t i)
+	{
+		const KernelFields<Scalar> fields = { m_x.data(), m_y.data(), m_vx.data(), m_vy.data(), m_rho.data(), m_p.data() };
+		Scalar forceX = 0.0, forceY = 0.0;
+		size_t candidates = 0;
+
+		forEachNeighborSpan(i, [&](const uint32_t* begin, const uint32_t* end) {
+			candidates += end - begin;
+			SphKernels<Isa, Scalar>::force(i, begin, end - begin, fields, m_params, forceX, forceY);
+		});
 
-					Eigen::Vector2d rij = m_particles[j].getPosition() - pi.getPosition();
-					float r2 = rij.squaredNorm();
+		m_fx[i] = forceX + m_params.gx * m_params.mass / fields.rho[i];
+		m_fy[i] = forceY + m_params.gy * m_params.mass / fields.rho[i];
+		return candidates;
+	}
 
-					if (r2 < HSQ) { // Only compute sqrt if within influence radius
-						float r = sqrt(r2); // Now only computed when necessary
+	// Euler step of particle i over dt, with the boundary conditions
+	void integrateParticle(size_t i, Scalar dt)
+	{
+		Scalar* x = m_x.data();
+		Scalar* y = m_y.data();
+		Scalar* vx = m_vx.data();
+		Scalar* vy = m_vy.data();
 
-						// pressure force
-						pressure += -rij.normalized() * MASS * (pi.getP() + m_particles[j].getP()) /
-							(2.0f * m_particles[j].getRho()) * W_SPIKY * pow(H - r, 3.f);
+		// Leapfrog Integration
+		vx[i] += dt * m_fx[i] / m_rho[i];
+		vy[i] += dt * m_fy[i] / m_rho[i];
+		x[i] += dt * vx[i];
+		y[i] += dt * vy[i];
 
-						// viscosity force
-						viscosity += VISC * MASS * (m_particles[j].getVelocity() - pi.getVelocity()) /
-							m_particles[j].getRho() * W_VISCOSITY * (H - r);
-					}
+		// enforce boundary conditions
+		if (openBoundaryActive()) {
+			return;
+		}
+		const Scalar boundary = m_params.boundary, damping = m_params.boundDamping;
+		if (x[i] - boundary < 0.f)
+		{
+			vx[i] *= damping;
+			x[i] = boundary;
+		}
+		if (x[i] + boundary > m_viewWidth)
+		{
+			vx[i] *= damping;
+			x[i] = m_viewWidth - boundary;
+		}
+		if (y[i] - boundary < 0.f)
+		{
+			vy[i] *= damping;
+			y[i] = boundary;
+		}
+		if (y[i] + boundary > m_viewHeight)
+		{
+			vy[i] *= damping;
+			y[i] = m_viewHeight - boundary;
+		}
+	}
+
+	// Bookkeeping at the end of every step
+	void finishStep(Scalar dt)
+	{
+		m_stepCount++;
+		m_simulatedTime += dt;
+		m_stats.endStep();
+	}
+
+	// The step() pipeline for one instruction set
+	template<SimdIsa Isa>
+	Scalar stepFused(Scalar remaining)
+	{
+		const bool instrumented = m_stats.isEnabled() || m_stats.getTrace() != nullptr;
+		const bool adaptive = m_adaptiveTimeStep;
+		const size_t n = size();
+
+		#pragma omp parallel
+		{
+			// The grid build needs runtime barriers, the phases after it only meet at spin barriers
+			buildGridOnTeam();
+			#pragma omp single
+			{
+				size_t team = static_cast<size_t>(omp_get_num_threads());
+				m_barrier.reset(static_cast<int>(team));
+				if (m_threadBounds.size() < team) {
+					m_threadBounds.resize(team);
+				}
+				if (m_balancedSchedule) {
+					m_schedule.setup(size(), static_cast<int>(team));
+					m_schedule.partition();
+				}
+				if (instrumented) {
+					m_stats.beginPhase(SolverPhase::Densities);
 				}
 			}
+			const int thread = omp_get_thread_num();
+			const size_t threads = static_cast<size_t>(m_barrier.getThreads());
+			const size_t begin = n * thread / threads, end = n * (thread + 1) / threads;
+			const uint32_t* order = m_cellParticles.data();
 
-			Eigen::Vector2d fgrav = G * MASS / pi.getRho();
-			pi.setForce(pressure + viscosity + fgrav);
+			NeighborCounts counts;
+			double start = omp_get_wtime();
+			if (m_balancedSchedule) {
+				runBalanced(thread, DensityPass, [&](size_t k) { return computeDensity<Isa>(order[k], counts); });
+			}
+			else {
+				for (size_t i = begin; i < end; ++i) {
+					computeDensity<Isa>(i, counts);
+				}
+			}
+			m_stats.recordThread(thread, start, omp_get_wtime(), counts);
+			m_barrier.wait();
+
+			// Phase changes fold every thread's slot, so nobody may record until thread 0 is done
+			if (instrumented) {
+				if (thread == 0) {
+					m_stats.endPhase(SolverPhase::Densities);
+					m_stats.beginPhase(SolverPhase::Forces);
+				}
+				m_barrier.wait();
+			}
+
+			TimeStepBounds bounds;
+			auto force = [&](size_t i) {
+				size_t candidates = computeForce<Isa>(i);
+				if (adaptive) {
+					Scalar fx, fy;
+					unsupportedForce(i, fx, fy);
+					bounds.add(m_vx[i], m_vy[i], fx, fy, m_rho[i]);
+				}
+				return candidates;
+			};
+			start = omp_get_wtime();
+			if (m_balancedSchedule) {
+				runBalanced(thread, ForcePass, [&](size_t k) { return force(order[k]); });
+			}
+			else {
+				for (size_t i = begin; i < end; ++i) {
+					force(i);
+				}
+			}
+			m_threadBounds[thread].bounds = bounds;
+			m_stats.recordThread(thread, start, omp_get_wtime(), NeighborCounts());
+			m_barrier.wait();
+
+			// Thread 0 combines the per-thread bounds into the step's dt
+			if (thread == 0) {
+				if (instrumented) {
+					m_stats.endPhase(SolverPhase::Forces);
+				}
+				TimeStepBounds all;
+				for (size_t t = 0; t < threads; ++t) {
+					all.merge(m_threadBounds[t].bounds);
+				}
+				m_dt = clipTimeStep(adaptive ? timeStepFromBounds(all) : m_params.dt, remaining);
+				if (instrumented) {
+					m_stats.beginPhase(SolverPhase::Integrate);
+				}
+			}
+			m_barrier.wait();
+
+			const Scalar dt = m_dt;
+			start = omp_get_wtime();
+			for (size_t i = begin; i < end; ++i) {
+				integrateParticle(i, dt);
+			}
+			m_stats.recordThread(thread, start, omp_get_wtime(), NeighborCounts());
 		}
+
+		if (instrumented) {
+			m_stats.endPhase(SolverPhase::Integrate);
+		}
+		finishStep(m_dt);
+		return m_dt;
 	}
 
-	// Integrating using Euler's method with OpenMP for parallelism
-	void Integrate()
+	// Candidates for the Verlet list of the particle at position k of m_cellParticles
+	template<typename Visitor>
+	void forEachListCandidate(size_t k, Visitor&& visit) {
+		size_t i = m_cellParticles[k];
+		if (symmetricPairsActive()) {
+			visit(i); // Each particle keeps itself, for the density self term
+			forEachHalfStencilSpan(k, [&](const uint32_t* begin, const uint32_t* end) {
+				for (const uint32_t* it = begin; it != end; ++it) {
+					visit(static_cast<size_t>(*it));
+				}
+			});
+		}
+		else {
+			forEachNeighbor(m_x[i], m_y[i], visit);
+		}
+	}
+
+	// Pair-symmetric density pass: each pair's poly6 term is added to both particles
+	void calculateDensitiesSymmetric()
 	{
+		const Scalar* x = m_x.data();
+		const Scalar* y = m_y.data();
+		Scalar* rho = m_rho.data();
+		Scalar* p = m_p.data();
+		const SphParameters<Scalar> params = m_params; // Local copy, so writing rho doesn't make the compiler reload it
+		const Scalar selfDensity = params.mass * params.wDensity * SmoothingKernel::density(Scalar(0), params.h, params.hsq);
+
 		#pragma omp parallel for
-		for (size_t i = 0; i < m_particles.size(); ++i)
+		for (size_t i = 0; i < size(); ++i)
 		{
-			auto& p = m_particles[i];
-			// Leapfrog Integration
-			p.setVelocity(p.getVelocity() + DT * p.getForce() / p.getRho());
-			p.setPosition(p.getPosition() + DT * p.getVelocity());
-
-			Eigen::Vector2d velocity = p.getVelocity();
-			Eigen::Vector2d position = p.getPosition();
+			rho[i] = m_useNeighborLists ? 0.0f : selfDensity; // Half lists already list the particle itself
+		}
 
-			// enforce boundary conditions
-			if (p.getPosition()(0) - BOUNDARY < 0.f)
+		forEachCellColored([&](int c, NeighborCounts& counts) {
+			for (uint32_t k = m_cellStart[c]; k < m_cellEnd[c]; ++k)
 			{
-				velocity(0) *= BOUND_DAMPING;
-				position(0) = BOUNDARY;
+				size_t i = m_cellParticles[k];
+				Scalar xi = x[i], yi = y[i];
+				Scalar rhoi = 0.0f;
+
+				forEachHalfNeighbor(k, [&](size_t j) {
+					Scalar rx = x[j] - xi;
+					Scalar ry = y[j] - yi;
+					Scalar r2 = rx * rx + ry * ry;
+
+					counts.tested++;
+					if (r2 < params.hsq) {
+						counts.accepted++;
+						Scalar w = params.mass * params.wDensity * SmoothingKernel::density(r2, params.h, params.hsq);
+						rhoi += w;
+						if (j != i) rho[j] += w;
+					}
+				});
+				rho[i] += rhoi;
 			}
-			if (p.getPosition()(0) + BOUNDARY > VIEW_WIDTH)
+		});
+
+		#pragma omp parallel for
+		for (size_t i = 0; i < size(); ++i)
+		{
+			p[i] = params.gasConstant * (rho[i] - params.restDensity); // Equation 12
+		}
+	}
+
+	// Pair-symmetric force pass: pressure and viscosity are evaluated once per pair and applied with opposite
+	// signs, each side scaled by the other particle's density as in calculateForces
+	void calculateForcesSymmetric()
+	{
+		const Scalar* x = m_x.data();
+		const Scalar* y = m_y.data();
+		const Scalar* vx = m_vx.data();
+		const Scalar* vy = m_vy.data();
+		const Scalar* rho = m_rho.data();
+		const Scalar* p = m_p.data();
+		Scalar* fx = m_fx.data();
+		Scalar* fy = m_fy.data();
+		const SphParameters<Scalar> params = m_params; // Local copy, so writing fx, fy doesn't make the compiler reload it
+
+		#pragma omp parallel for
+		for (size_t i = 0; i < size(); ++i)
+		{
+			fx[i] = params.gx * params.mass / rho[i];
+			fy[i] = params.gy * params.mass / rho[i];
+		}
+
+		forEachCellColored([&](int c, NeighborCounts&) {
+			for (uint32_t k = m_cellStart[c]; k < m_cellEnd[c]; ++k)
 			{
-				velocity(0) *= BOUND_DAMPING;
-				position(0) = VIEW_WIDTH - BOUNDARY;
+				size_t i = m_cellParticles[k];
+				Scalar xi = x[i], yi = y[i];
+				Scalar fxi = 0.0, fyi = 0.0;
+
+				forEachHalfNeighbor(k, [&](size_t j) {
+					if (i == j) return;
+
+					Scalar rx = x[j] - xi;
+					Scalar ry = y[j] - yi;
+					Scalar r2 = rx * rx + ry * ry;
+
+					if (r2 < params.hsq) {
+						Scalar dist = std::sqrt(rx * rx + ry * ry);
+						Scalar r = dist;
+
+						// pressure along rij.normalized(), shared by both sides
+						Scalar pressureScale = dist > 0.0 ? params.mass * (p[i] + p[j]) / 2.0f * params.wGradient * SmoothingKernel::gradient(r, params.h) : 0.0;
+
+						// viscosity, shared by both sides
+						Scalar viscosityScale = params.viscosity * params.mass * params.wLaplacian * SmoothingKernel::laplacian(r, params.h);
+						Scalar dvx = vx[j] - vx[i];
+						Scalar dvy = vy[j] - vy[i];
+
+						fxi += (-pressureScale * rx + viscosityScale * dvx) / rho[j];
+						fyi += (-pressureScale * ry + viscosityScale * dvy) / rho[j];
+						fx[j] += (pressureScale * rx - viscosityScale * dvx) / rho[i];
+						fy[j] += (pressureScale * ry - viscosityScale * dvy) / rho[i];
+					}
+				});
+				fx[i] += fxi;
+				fy[i] += fyi;
 			}
-			if (p.getPosition()(1) - BOUNDARY < 0.f)
-			{
-				velocity(1) *= BOUND_DAMPING;
-				position(1) = BOUNDARY;
+		});
+	}
+
+	// Runs body(i, counts) for every particle on the OpenMP team. counts is the calling thread's, and each thread's
+	// busy time and counts go to the step stats
+	template<typename Body>
+	void forEachParticleParallel(Body&& body) {
+		#pragma omp parallel
+		{
+			NeighborCounts counts;
+			double start = omp_get_wtime();
+			#pragma omp for nowait
+			for (size_t i = 0; i < size(); ++i) {
+				body(i, counts);
 			}
-			if (p.getPosition()(1) + BOUNDARY > VIEW_HEIGHT)
-			{
-				velocity(1) *= BOUND_DAMPING;
-				position(1) = VIEW_HEIGHT - BOUNDARY;
+			m_stats.recordThread(omp_get_thread_num(), start, omp_get_wtime(), counts);
+		}
+	}
+
+	// What the adaptive dt depends on: fastest particle, largest acceleration and lowest density
+	struct TimeStepBounds {
+		Scalar maxSpeed2 = 0, maxAcceleration2 = 0;
+		Scalar minDensity = std::numeric_limits<Scalar>::max();
+
+		void add(Scalar vx, Scalar vy, Scalar fx, Scalar fy, Scalar rho) {
+			Scalar speed2 = vx * vx + vy * vy;
+			Scalar acceleration2 = (fx * fx + fy * fy) / (rho * rho); // Integrate applies f / rho
+			maxSpeed2 = speed2 > maxSpeed2 ? speed2 : maxSpeed2;
+			maxAcceleration2 = acceleration2 > maxAcceleration2 ? acceleration2 : maxAcceleration2;
+			minDensity = rho < minDensity ? rho : minDensity;
+		}
+		void merge(const TimeStepBounds& other) {
+			maxSpeed2 = other.maxSpeed2 > maxSpeed2 ? other.maxSpeed2 : maxSpeed2;
+			maxAcceleration2 = other.maxAcceleration2 > maxAcceleration2 ? other.maxAcceleration2 : maxAcceleration2;
+			minDensity = other.minDensity < minDensity ? other.minDensity : minDensity;
+		}
+	};
+
+	// Per-thread bounds of the fused step, a cache line each
+	struct alignas(64) ThreadBounds {
+		TimeStepBounds bounds;
+	};
+
+	// Per-thread partial results of the team grid build, a cache line each
+	struct alignas(64) TeamSlot {
+		Scalar displacement2 = 0;
+		size_t movers = 0, occupied = 0, fullest = 0;
+		bool overflow = false;
+	};
+
+	// Largest dt the CFL, force and viscosity criteria allow, from parallel reductions over all particles
+	Scalar stableTimeStep() {
+		const Scalar* vx = m_vx.data();
+		const Scalar* vy = m_vy.data();
+		const Scalar* rho = m_rho.data();
+		Scalar maxSpeed2 = 0, maxAcceleration2 = 0;
+		Scalar minDensity = std::numeric_limits<Scalar>::max();
+
+		#pragma omp parallel for reduction(max : maxSpeed2, maxAcceleration2) reduction(min : minDensity)
+		for (size_t i = 0; i < size(); ++i) {
+			Scalar fx, fy;
+			unsupportedForce(i, fx, fy);
+			Scalar speed2 = vx[i] * vx[i] + vy[i] * vy[i];
+			Scalar acceleration2 = (fx * fx + fy * fy) / (rho[i] * rho[i]); // Integrate applies f / rho
+			maxSpeed2 = speed2 > maxSpeed2 ? speed2 : maxSpeed2;
+			maxAcceleration2 = acceleration2 > maxAcceleration2 ? acceleration2 : maxAcceleration2;
+			minDensity = rho[i] < minDensity ? rho[i] : minDensity;
+		}
+
+		TimeStepBounds all;
+		all.maxSpeed2 = maxSpeed2;
+		all.maxAcceleration2 = maxAcceleration2;
+		all.minDensity = minDensity;
+		return timeStepFromBounds(all);
+	}
+
+	// Force on particle i less the part a wall it rests on takes up. Integrate puts a particle pushed into a wall
+	// back onto it, so that part never moves the particle and mustn't shrink the time step. Otherwise the particles
+	// pinned in the corners of a settled pool set dt for everyone
+	void unsupportedForce(size_t i, Scalar& fx, Scalar& fy) const {
+		const Scalar boundary = m_params.boundary;
+		fx = m_fx[i];
+		fy = m_fy[i];
+		if (openBoundaryActive()) {
+			return;
+		}
+		if ((fx < 0 && m_x[i] <= boundary) || (fx > 0 && m_x[i] >= m_viewWidth - boundary)) {
+			fx = 0;
+		}
+		if ((fy < 0 && m_y[i] <= boundary) || (fy > 0 && m_y[i] >= m_viewHeight - boundary)) {
+			fy = 0;
+		}
+	}
+
+	// Largest dt the criteria allow for the given bounds
+	Scalar timeStepFromBounds(const TimeStepBounds& bounds) const {
+		// Sound speed of the equation of state p = GAS_CONST * (rho - REST_DENS)
+		const Scalar soundSpeed = std::sqrt(m_params.gasConstant);
+		Scalar dt = m_params.dtMax;
+		dt = std::min(dt, C::CFL_FACTOR * m_params.h / (soundSpeed + std::sqrt(bounds.maxSpeed2)));
+		if (bounds.maxAcceleration2 > 0) {
+			dt = std::min(dt, C::FORCE_FACTOR * std::sqrt(m_params.h / std::sqrt(bounds.maxAcceleration2)));
+		}
+		if (bounds.minDensity > 0 && bounds.minDensity < std::numeric_limits<Scalar>::max()) {
+			dt = std::min(dt, C::VISCOSITY_FACTOR * m_params.hsq * bounds.minDensity / m_params.viscosity);
+		}
+		return std::max(dt, m_params.dtMin);
+	}
+
+	// Never steps past remaining, and splits the last two steps evenly so the final one isn't a sliver
+	static Scalar clipTimeStep(Scalar dt, Scalar remaining) {
+		if (remaining <= dt) {
+			return remaining;
+		}
+		if (remaining < 2 * dt) {
+			return remaining / 2;
+		}
+		return dt;
+	}
+
+	// Occupied cells and the fullest one, for the step stats
+	void recordGridOccupancy() {
+		const size_t cells = m_cellStart.size();
+		size_t occupied = 0, fullest = 0;
+		#pragma omp for nowait
+		for (size_t c = 0; c < cells; ++c) {
+			size_t count = m_cellEnd[c] - m_cellStart[c];
+			occupied += count > 0;
+			fullest = count > fullest ? count : fullest;
+		}
+		m_teamSlots[omp_get_thread_num()].occupied = occupied;
+		m_teamSlots[omp_get_thread_num()].fullest = fullest;
+		#pragma omp barrier
+		#pragma omp single
+		{
+			occupied = fullest = 0;
+			for (int t = 0; t < omp_get_num_threads(); ++t) {
+				occupied += m_teamSlots[t].occupied;
+				fullest = std::max(fullest, m_teamSlots[t].fullest);
+			}
+			m_stats.recordGrid(size(), cells, occupied, fullest);
+		}
+	}
+
+	// Sizes the grid to cover the view, only reallocates when the view or particle count changes
+	void resizeGrid() {
+		// Neighbor lists gather everything within h + the skin, so the 3x3 stencil needs cells at least that wide
+		Scalar cellSize = m_useNeighborLists ? m_params.h + m_params.neighborSkin : m_params.h;
+		int width = static_cast<int>(m_viewWidth / cellSize) + 1;
+		int height = static_cast<int>(m_viewHeight / cellSize) + 1;
+
+		// The hash table is a power of two of at least HashSlotsPerParticle slots per particle
+		size_t tableSize = 0;
+		if (m_hashGrid) {
+			width = height = 0;
+			tableSize = 1;
+			m_hashTableBits = 0;
+			while (tableSize < HashSlotsPerParticle * size()) {
+				tableSize <<= 1;
+				m_hashTableBits++;
 			}
+		}
 
-			p.setVelocity(velocity);
-			p.setPosition(position);
+		if (cellSize != m_cellSize || width != m_gridWidth || height != m_gridHeight || tableSize != m_hashTableSize
+			|| m_particleCell.size() != size()) {
+			m_cellsCurrent = false; // The last build's cells don't apply anymore
+		}
+		m_cellSize = cellSize;
+		m_gridWidth = width;
+		m_gridHeight = height;
+		m_hashTableSize = tableSize;
+		size_t cells = m_hashGrid ? tableSize : static_cast<size_t>(m_gridWidth) * m_gridHeight;
+		if (m_cellStart.size() != cells) {
+			m_cellStart.assign(cells, 0);
+			m_cellEnd.assign(cells, 0);
 		}
+		m_particleCell.resize(size());
+		m_cellParticles.resize(size());
+
+		// Incremental update buffers, sized for the most movers it handles
+		size_t maxMovers = size() / MaxChurnDivisor;
+		if (m_movers.size() != maxMovers) {
+			m_movers.resize(maxMovers);
+			m_cellEvents.resize(2 * maxMovers);
+		}
+		m_cellScratch.reserve(size());
 	}
-private:
-	std::vector<Particle> m_particles;
+
+	// Hash table slots per particle, twice as many keeps collisions rare (Ihmsen et al.), and the most stencil
+	// candidates gathered per kernel call
+	static const size_t HashSlotsPerParticle = 2;
+	static const size_t HashGatherSize = 128;
+
+	// Most particles an incremental update moves, as a divisor of the count, and the mover flag in m_particleCell
+	static const size_t MaxChurnDivisor = 16;
+	static const uint32_t MovedMark = 0xFFFFFFFF;
+
+	// Smallest scene and team the parallel sort pays off on
+	static const size_t ParallelSortMinParticles = 16384;
+	static const int ParallelSortMinThreads = 4;
+
+	// Spreads the 32 bits of v out to the even bits of a 64-bit word, for the hash grid's Morton codes
+	static uint64_t interleaveBits32(uint32_t v) {
+		uint64_t x = v;
+		x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+		x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+		x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+		x = (x | (x << 2)) & 0x3333333333333333ull;
+		x = (x | (x << 1)) & 0x5555555555555555ull;
+		return x;
+	}
+
+	// Spreads the low 16 bits of v out to the even bits, for Morton codes
+	static uint64_t interleaveBits(uint32_t v) {
+		uint64_t x = v & 0xFFFF;
+		x = (x | (x << 8)) & 0x00FF00FF;
+		x = (x | (x << 4)) & 0x0F0F0F0F;
+		x = (x | (x << 2)) & 0x33333333;
+		x = (x | (x << 1)) & 0x55555555;
+		return x;
+	}
+
+	// Applies the order in m_sortKeys to one field array, scratch is kept around so this doesn't allocate after the first use
+	template<typename T>
+	void permute(std::vector<T>& field, std::vector<T>& scratch) {
+		#pragma omp single
+		scratch.resize(field.size());
+		#pragma omp for
+		for (size_t k = 0; k < field.size(); ++k) {
+			scratch[k] = field[static_cast<uint32_t>(m_sortKeys[k])];
+		}
+		#pragma omp single
+		field.swap(scratch);
+	}
+
+	// Dense uniform grid, indices are 32-bit to keep the sorted index array compact. With a hash grid the "cells"
+	// below are hash table slots and the grid has no width or height
+	Scalar m_cellSize = C::H;
+	int m_gridWidth = 0, m_gridHeight = 0;
+	bool m_hashGrid = false;
+	size_t m_hashTableSize = 0; // Power of two, 0 for the dense grid
+	int m_hashTableBits = 0;
+	std::vector<uint32_t> m_cellStart, m_cellEnd; // Per-cell range into m_cellParticles
+	std::vector<uint32_t> m_cellParticles; // Particle indices sorted by cell
+	std::vector<uint32_t> m_particleCell; // Cell of each particle
+	std::vector<uint32_t> m_blockOffsets; // Per-thread cell block offsets of the parallel sort
+
+	// Incremental grid updates
+	bool m_incrementalGrid = true;
+	bool m_cellsCurrent = false; // m_particleCell and the cell ranges are from a build of the current grid
+	size_t m_gridRebuilds = 0, m_gridUpdates = 0;
+	std::vector<uint64_t> m_movers; // New cell << 32 | index, one slice per thread while finding them
+	std::vector<uint64_t> m_cellEvents;
+	std::vector<uint32_t> m_cellScratch;
+	std::vector<TeamSlot> m_teamSlots; // Sized to the largest team that built the grid
+
+	// Particle fields, one array per field
+	std::vector<Scalar> m_x, m_y; // position
+	std::vector<Scalar> m_vx, m_vy; // velocity
+	std::vector<Scalar> m_fx, m_fy; // force
+	std::vector<Scalar> m_rho; // density
+	std::vector<Scalar> m_p; // pressure
+	std::vector<uint32_t> m_ids; // stable particle id
+	uint32_t m_nextId = 0;
+
+	// Spatial reordering
+	size_t m_reorderInterval = 0;
+	size_t m_nextReorderStep = 0;
+	size_t m_stepCount = 0;
+	std::vector<uint64_t> m_sortKeys; // Morton code << 32 | particle index
+	std::vector<Scalar> m_scratch;
+	std::vector<uint32_t> m_scratchIds;
+
+	StepStats m_stats;
+
+	SphParameters<Scalar> m_params;
+
+	// Time stepping
+	bool m_adaptiveTimeStep = false;
+	Scalar m_dt = C::DT;
+	double m_simulatedTime = 0.0;
+
+	// Fused step
+	SpinBarrier m_barrier;
+	std::vector<ThreadBounds> m_threadBounds;
+
+	// Balanced schedule of the density and force passes, split by the candidates each block tested last time
+	static const int DensityPass = 0, ForcePass = 1;
+	static const uint64_t ParticleBaseCost = 8; // Per-particle work besides its candidates, in candidate units
+	bool m_balancedSchedule = true;
+	BalancedSchedule m_schedule;
+
+	// Kernel options
+	bool m_useSymmetricPairs = false;
+	bool m_openBoundary = false;
+	SimdIsa m_simdIsa = detectSimdIsa();
+
+	// Verlet neighbor lists
+	bool m_useNeighborLists = false;
+	bool m_neighborListsValid = false;
+	size_t m_neighborListBuilds = 0;
+	size_t m_neighborListGrowths = 0;
+	std::vector<uint32_t> m_neighborStart; // Per-particle range into m_neighborList, size() + 1 long
+	std::vector<uint32_t> m_neighborList;
+	std::vector<Scalar> m_listX, m_listY; // Positions when the lists were built
+	double m_viewWidth = VIEW_WIDTH, m_viewHeight = VIEW_HEIGHT;
 };
 
+// Particle list at the precision the solver is built with
+typedef BasicParticleList<Real> ParticleList;
+
 #endif
\ No newline at end of file
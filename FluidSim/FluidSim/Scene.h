@@ -0,0 +1,61 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "Constants.h"
+#include "Particles.h"
+#include <cstdlib>
+
+// Scene setup shared by the windowed app and the headless runner
+
+// Number of particles the dam block fits in a view of the given size, for kernel radius h
+inline size_t damCapacity(double viewWidth, double viewHeight, float h)
+{
+	const float boundary = h;
+	size_t capacity = 0;
+	for (float y = boundary + 8 * h; y < viewHeight - boundary * 2.f; y += h)
+	{
+		for (float x = viewWidth / 4; x <= viewWidth / 2; x += h)
+		{
+			capacity++;
+		}
+	}
+	return capacity;
+}
+
+// Grows the particle list's view (keeping its aspect ratio) until the dam block fits count particles
+inline void fitViewToParticles(ParticleList& particles, size_t count)
+{
+	double width = particles.getViewWidth();
+	double height = particles.getViewHeight();
+	const float h = static_cast<float>(particles.getParameters().h);
+	while (damCapacity(width, height, h) < count)
+	{
+		width *= 1.1;
+		height *= 1.1;
+	}
+	particles.setView(width, height);
+}
+
+// Initializes SPH by spwaning in the particles, code was modified from Lucas-Schuermann
+inline void initSPH(ParticleList& particles, size_t count = DAM_PARTICLES)
+{
+	const float h = static_cast<float>(particles.getParameters().h);
+	const float boundary = static_cast<float>(particles.getParameters().boundary);
+	for (float y = boundary + 8 * h; y < particles.getViewHeight() - boundary * 2.f; y += h)
+	{
+		for (float x = particles.getViewWidth() / 4; x <= particles.getViewWidth() / 2; x += h)
+		{
+			if (particles.size() < count)
+			{
+				float jitter = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
+				particles.addParticle(Particle(x + jitter, y));
+			}
+			else
+			{
+				return;
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,560 @@
+#ifndef SCENE_CONFIG_H
+#define SCENE_CONFIG_H
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Constants.h"
+#include "Particles.h"
+#include "Scene.h"
+
+// Scene files: the SPH parameters, view and initial fluid of a run as JSON, so a parameter sweep or a new setup
+// doesn't need a rebuild. Every key is optional, anything left out keeps the compiled-in default (Constants.h):
+//
+//   {
+//     "parameters": { "restDensity": 300, "gasConstant": 2000, "h": 16, "mass": 2.5, "viscosity": 200,
+//                     "dt": 0.0007, "gravity": [0, -9.81], "boundDamping": -0.5, "neighborSkin": 0.5 },
+//     "view": { "width": 800, "height": 600, "fit": true, "walls": true },
+//     "dam": { "particles": 400 },
+//     "fluid": [ { "min": [100, 100], "max": [300, 400], "spacing": 16, "jitter": 1,
+//                  "velocity": [0, 0], "maxParticles": 0 } ]
+//   }
+//
+// "neighborSkin" is the Verlet list margin (--neighbor-lists) as a fraction of h.
+// "dam" is the default dam break block of initSPH, and "fit" grows the view until it holds that many particles.
+// "walls": false makes the boundary open, so particles can leave the view. That needs the hash grid (--hash-grid),
+// the dense grid keeps the walls.
+// "fluid" lists rectangular blocks filled on a grid of the given spacing (h when left out), each particle moved by
+// up to jitter along x like the dam. A scene with "fluid" blocks and no "dam" only has the blocks.
+// Unknown keys are errors, so a misspelt parameter doesn't silently run with the default.
+
+// Just enough of JSON for scene files
+struct JsonValue {
+	enum Type { Null, Bool, Number, String, Array, Object };
+	Type type = Null;
+	bool boolean = false;
+	double number = 0.0;
+	std::string string;
+	std::vector<JsonValue> items; // Array
+	std::vector<std::pair<std::string, JsonValue>> members; // Object, in file order
+	int line = 1; // Where the value starts, for error messages
+};
+
+class JsonParser {
+public:
+	// Parses text into value. Returns false with "line N: reason" in error if it isn't valid JSON
+	bool parse(const std::string& text, JsonValue& value, std::string& error) {
+		m_text = text.c_str();
+		m_end = m_text + text.size();
+		m_line = 1;
+		m_error.clear();
+		skipSpace();
+		bool ok = parseValue(value, 0);
+		if (ok) {
+			skipSpace();
+			if (m_text != m_end) {
+				ok = fail("unexpected text after the end");
+			}
+		}
+		if (!ok) {
+			error = m_error;
+		}
+		return ok;
+	}
+
+private:
+	static const int MaxDepth = 64;
+
+	bool fail(const std::string& reason) {
+		m_error = "line " + std::to_string(m_line) + ": " + reason;
+		return false;
+	}
+
+	void skipSpace() {
+		while (m_text != m_end && (*m_text == ' ' || *m_text == '\t' || *m_text == '\r' || *m_text == '\n')) {
+			if (*m_text == '\n') {
+				m_line++;
+			}
+			m_text++;
+		}
+	}
+
+	bool literal(const char* word) {
+		size_t length = std::strlen(word);
+		if (static_cast<size_t>(m_end - m_text) < length || std::strncmp(m_text, word, length) != 0) {
+			return false;
+		}
+		m_text += length;
+		return true;
+	}
+
+	bool parseValue(JsonValue& value, int depth) {
+		if (depth > MaxDepth) {
+			return fail("nested too deeply");
+		}
+		value.line = m_line;
+		if (m_text == m_end) {
+			return fail("unexpected end of file");
+		}
+		switch (*m_text) {
+		case '{':
+			return parseObject(value, depth);
+		case '[':
+			return parseArray(value, depth);
+		case '"':
+			value.type = JsonValue::String;
+			return parseString(value.string);
+		case 't':
+		case 'f':
+			value.type = JsonValue::Bool;
+			value.boolean = *m_text == 't';
+			return literal(value.boolean ? "true" : "false") || fail("invalid literal");
+		case 'n':
+			value.type = JsonValue::Null;
+			return literal("null") || fail("invalid literal");
+		default:
+			return parseNumber(value);
+		}
+	}
+
+	bool parseNumber(JsonValue& value) {
+		// strtod accepts more than JSON does (hex, inf, leading +), so check the first character ourselves
+		if (*m_text != '-' && (*m_text < '0' || *m_text > '9')) {
+			return fail(std::string("unexpected '") + *m_text + "'");
+		}
+		std::string digits;
+		while (m_text != m_end && (std::strchr("+-.eE", *m_text) || (*m_text >= '0' && *m_text <= '9'))) {
+			digits += *m_text++;
+		}
+		char* end = nullptr;
+		value.type = JsonValue::Number;
+		value.number = std::strtod(digits.c_str(), &end);
+		if (*end != '\0' || !isJsonNumber(digits.c_str())) {
+			return fail("invalid number " + digits);
+		}
+		return true;
+	}
+
+	// strtod also takes leading zeros and a bare '.' before or after the digits, JSON doesn't:
+	// -? (0 | [1-9][0-9]*) (.[0-9]+)? ([eE][+-]?[0-9]+)?
+	static bool isJsonNumber(const char* text) {
+		auto digits = [&text]() {
+			const char* start = text;
+			while (*text >= '0' && *text <= '9') {
+				text++;
+			}
+			return text - start;
+		};
+		if (*text == '-') {
+			text++;
+		}
+		if (*text == '0') {
+			text++;
+		}
+		else if (digits() == 0) {
+			return false;
+		}
+		if (*text == '.') {
+			text++;
+			if (digits() == 0) {
+				return false;
+			}
+		}
+		if (*text == 'e' || *text == 'E') {
+			text++;
+			if (*text == '+' || *text == '-') {
+				text++;
+			}
+			if (digits() == 0) {
+				return false;
+			}
+		}
+		return *text == '\0';
+	}
+
+	bool parseString(std::string& string) {
+		m_text++; // Opening quote
+		for (;;) {
+			if (m_text == m_end || *m_text == '\n') {
+				return fail("unterminated string");
+			}
+			char c = *m_text++;
+			if (c == '"') {
+				return true;
+			}
+			if (c != '\\') {
+				string += c;
+				continue;
+			}
+			if (m_text == m_end) {
+				return fail("unterminated string");
+			}
+			switch (*m_text++) {
+			case '"': string += '"'; break;
+			case '\\': string += '\\'; break;
+			case '/': string += '/'; break;
+			case 'b': string += '\b'; break;
+			case 'f': string += '\f'; break;
+			case 'n': string += '\n'; break;
+			case 'r': string += '\r'; break;
+			case 't': string += '\t'; break;
+			default: return fail("unsupported escape in string"); // \u isn't needed for keys and paths
+			}
+		}
+	}
+
+	bool parseArray(JsonValue& value, int depth) {
+		value.type = JsonValue::Array;
+		m_text++;
+		skipSpace();
+		if (m_text != m_end && *m_text == ']') {
+			m_text++;
+			return true;
+		}
+		for (;;) {
+			value.items.emplace_back();
+			if (!parseValue(value.items.back(), depth + 1)) {
+				return false;
+			}
+			skipSpace();
+			if (m_text == m_end) {
+				return fail("unterminated array");
+			}
+			char c = *m_text++;
+			if (c == ']') {
+				return true;
+			}
+			if (c != ',') {
+				return fail("expected ',' or ']' in array");
+			}
+			skipSpace();
+		}
+	}
+
+	bool parseObject(JsonValue& value, int depth) {
+		value.type = JsonValue::Object;
+		m_text++;
+		skipSpace();
+		if (m_text != m_end && *m_text == '}') {
+			m_text++;
+			return true;
+		}
+		for (;;) {
+			if (m_text == m_end || *m_text != '"') {
+				return fail("expected a quoted key");
+			}
+			std::string key;
+			if (!parseString(key)) {
+				return false;
+			}
+			for (auto& member : value.members) {
+				if (member.first == key) {
+					return fail("duplicate key \"" + key + "\"");
+				}
+			}
+			skipSpace();
+			if (m_text == m_end || *m_text != ':') {
+				return fail("expected ':' after \"" + key + "\"");
+			}
+			m_text++;
+			skipSpace();
+			value.members.emplace_back(key, JsonValue());
+			if (!parseValue(value.members.back().second, depth + 1)) {
+				return false;
+			}
+			skipSpace();
+			if (m_text == m_end) {
+				return fail("unterminated object");
+			}
+			char c = *m_text++;
+			if (c == '}') {
+				return true;
+			}
+			if (c != ',') {
+				return fail("expected ',' or '}' in object");
+			}
+			skipSpace();
+		}
+	}
+
+	const char* m_text = nullptr;
+	const char* m_end = nullptr;
+	int m_line = 1;
+	std::string m_error;
+};
+
+// A rectangle of fluid, filled on a grid
+struct FluidBlock {
+	double minX = 0.0, minY = 0.0, maxX = 0.0, maxY = 0.0;
+	double spacing = 0.0; // 0 uses the kernel radius h
+	double jitter = 1.0; // Random offset along x of up to this much, so the particles don't stack exactly
+	double vx = 0.0, vy = 0.0; // Initial velocity
+	size_t maxParticles = 0; // 0 fills the whole block
+};
+
+struct SceneConfig {
+	SphParameters<double> parameters; // Converted to the solver's precision by initScene
+	double viewWidth = VIEW_WIDTH, viewHeight = VIEW_HEIGHT;
+	bool fitView = true; // Grow the view until the dam fits
+	bool walls = true; // false for an open boundary, see ParticleList::setOpenBoundary
+	size_t damParticles = DAM_PARTICLES;
+	std::vector<FluidBlock> blocks;
+};
+
+// Reading a parsed scene into a SceneConfig. Every reader returns false with "line N: reason" in error
+class SceneReader {
+public:
+	bool read(const JsonValue& root, SceneConfig& scene, std::string& error) {
+		m_error = &error;
+		if (!expect(root, JsonValue::Object, "the scene")) {
+			return false;
+		}
+		bool hasDam = false, hasFluid = false;
+		for (auto& member : root.members) {
+			const std::string& key = member.first;
+			const JsonValue& value = member.second;
+			bool ok;
+			if (key == "parameters") {
+				ok = readParameters(value, scene.parameters);
+			}
+			else if (key == "view") {
+				ok = readView(value, scene);
+			}
+			else if (key == "dam") {
+				hasDam = true;
+				ok = readDam(value, scene);
+			}
+			else if (key == "fluid") {
+				hasFluid = true;
+				ok = readFluid(value, scene.blocks);
+			}
+			else {
+				ok = unknownKey(value, key, "the scene");
+			}
+			if (!ok) {
+				return false;
+			}
+		}
+		if (hasFluid && !hasDam) {
+			scene.damParticles = 0;
+		}
+		return true;
+	}
+
+private:
+	bool fail(const JsonValue& value, const std::string& reason) {
+		*m_error = "line " + std::to_string(value.line) + ": " + reason;
+		return false;
+	}
+	bool unknownKey(const JsonValue& value, const std::string& key, const char* where) {
+		return fail(value, "unknown key \"" + key + "\" in " + where);
+	}
+	bool expect(const JsonValue& value, JsonValue::Type type, const std::string& what) {
+		static const char* const names[] = { "null", "true or false", "a number", "a string", "an array", "an object" };
+		return value.type == type || fail(value, what + " must be " + names[type]);
+	}
+
+	bool number(const JsonValue& value, const std::string& what, double& result) {
+		if (!expect(value, JsonValue::Number, what)) {
+			return false;
+		}
+		result = value.number;
+		return true;
+	}
+	bool positive(const JsonValue& value, const std::string& what, double& result) {
+		return number(value, what, result) && (result > 0.0 || fail(value, what + " must be positive"));
+	}
+	bool nonNegative(const JsonValue& value, const std::string& what, double& result) {
+		return number(value, what, result) && (result >= 0.0 || fail(value, what + " can't be negative"));
+	}
+	bool count(const JsonValue& value, const std::string& what, size_t& result) {
+		double parsed;
+		if (!nonNegative(value, what, parsed)) {
+			return false;
+		}
+		if (parsed != static_cast<double>(static_cast<size_t>(parsed))) {
+			return fail(value, what + " must be a whole number");
+		}
+		result = static_cast<size_t>(parsed);
+		return true;
+	}
+	bool pair(const JsonValue& value, const std::string& what, double& x, double& y) {
+		if (!expect(value, JsonValue::Array, what)) {
+			return false;
+		}
+		if (value.items.size() != 2) {
+			return fail(value, what + " must be [x, y]");
+		}
+		return number(value.items[0], what, x) && number(value.items[1], what, y);
+	}
+
+	bool readParameters(const JsonValue& object, SphParameters<double>& params) {
+		if (!expect(object, JsonValue::Object, "parameters")) {
+			return false;
+		}
+		for (auto& member : object.members) {
+			const std::string& key = member.first;
+			const JsonValue& value = member.second;
+			bool ok;
+			if (key == "restDensity") ok = positive(value, key, params.restDensity);
+			else if (key == "gasConstant") ok = nonNegative(value, key, params.gasConstant);
+			else if (key == "h") ok = positive(value, key, params.h);
+			else if (key == "mass") ok = positive(value, key, params.mass);
+			else if (key == "viscosity") ok = nonNegative(value, key, params.viscosity);
+			else if (key == "dt") ok = positive(value, key, params.dt);
+			else if (key == "gravity") ok = pair(value, key, params.gx, params.gy);
+			else if (key == "boundDamping") ok = number(value, key, params.boundDamping);
+			else if (key == "neighborSkin") ok = positive(value, key, params.neighborSkinFactor);
+			else ok = unknownKey(value, key, "parameters");
+			if (!ok) {
+				return false;
+			}
+		}
+		params.update();
+		return true;
+	}
+
+	bool readView(const JsonValue& object, SceneConfig& scene) {
+		if (!expect(object, JsonValue::Object, "view")) {
+			return false;
+		}
+		for (auto& member : object.members) {
+			const std::string& key = member.first;
+			const JsonValue& value = member.second;
+			bool ok;
+			if (key == "width") ok = positive(value, key, scene.viewWidth);
+			else if (key == "height") ok = positive(value, key, scene.viewHeight);
+			else if (key == "fit") {
+				ok = expect(value, JsonValue::Bool, key);
+				scene.fitView = value.boolean;
+			}
+			else if (key == "walls") {
+				ok = expect(value, JsonValue::Bool, key);
+				scene.walls = value.boolean;
+			}
+			else ok = unknownKey(value, key, "view");
+			if (!ok) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool readDam(const JsonValue& object, SceneConfig& scene) {
+		if (!expect(object, JsonValue::Object, "dam")) {
+			return false;
+		}
+		for (auto& member : object.members) {
+			bool ok = member.first == "particles" ? count(member.second, member.first, scene.damParticles)
+				: unknownKey(member.second, member.first, "dam");
+			if (!ok) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool readFluid(const JsonValue& array, std::vector<FluidBlock>& blocks) {
+		if (!expect(array, JsonValue::Array, "fluid")) {
+			return false;
+		}
+		for (auto& object : array.items) {
+			if (!expect(object, JsonValue::Object, "a fluid block")) {
+				return false;
+			}
+			FluidBlock block;
+			bool hasMin = false, hasMax = false;
+			for (auto& member : object.members) {
+				const std::string& key = member.first;
+				const JsonValue& value = member.second;
+				bool ok;
+				if (key == "min") ok = hasMin = pair(value, key, block.minX, block.minY);
+				else if (key == "max") ok = hasMax = pair(value, key, block.maxX, block.maxY);
+				else if (key == "spacing") ok = nonNegative(value, key, block.spacing);
+				else if (key == "jitter") ok = nonNegative(value, key, block.jitter);
+				else if (key == "velocity") ok = pair(value, key, block.vx, block.vy);
+				else if (key == "maxParticles") ok = count(value, key, block.maxParticles);
+				else ok = unknownKey(value, key, "a fluid block");
+				if (!ok) {
+					return false;
+				}
+			}
+			if (!hasMin || !hasMax) {
+				return fail(object, "a fluid block needs \"min\" and \"max\"");
+			}
+			if (block.maxX < block.minX || block.maxY < block.minY) {
+				return fail(object, "a fluid block's max must not be below its min");
+			}
+			blocks.push_back(block);
+		}
+		return true;
+	}
+
+	std::string* m_error = nullptr;
+};
+
+// Reads the scene file at path into scene. Returns false with the reason in error if it can't be read
+inline bool loadSceneConfig(const std::string& path, SceneConfig& scene, std::string& error)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file) {
+		error = "can't open " + path;
+		return false;
+	}
+	std::stringstream text;
+	text << file.rdbuf();
+
+	JsonValue root;
+	JsonParser parser;
+	scene = SceneConfig();
+	if (!parser.parse(text.str(), root, error) || !SceneReader().read(root, scene, error)) {
+		error = path + ":" + error.substr(std::strlen("line "));
+		return false;
+	}
+	return true;
+}
+
+// Fills block with particles, row by row from its min corner, until it or count runs out
+inline void spawnFluidBlock(ParticleList& particles, const FluidBlock& block)
+{
+	const double spacing = block.spacing > 0.0 ? block.spacing : static_cast<double>(particles.getParameters().h);
+	const size_t limit = block.maxParticles > 0 ? particles.size() + block.maxParticles : static_cast<size_t>(-1);
+	for (size_t row = 0; block.minY + row * spacing <= block.maxY; ++row)
+	{
+		for (size_t column = 0; block.minX + column * spacing <= block.maxX; ++column)
+		{
+			if (particles.size() >= limit)
+			{
+				return;
+			}
+			double jitter = block.jitter * static_cast<double>(rand()) / static_cast<double>(RAND_MAX);
+			Particle particle(static_cast<Real>(block.minX + column * spacing + jitter), static_cast<Real>(block.minY + row * spacing));
+			particle.setVelocity(Particle::Vector2(static_cast<Real>(block.vx), static_cast<Real>(block.vy)));
+			particles.addParticle(particle);
+		}
+	}
+}
+
+// Sets the particle list up as scene describes: its parameters, view, dam and fluid blocks. The default
+// SceneConfig is the dam break the app has always started with
+inline void initScene(ParticleList& particles, const SceneConfig& scene)
+{
+	particles.setParameters(scene.parameters.convert<Real>());
+	particles.setView(scene.viewWidth, scene.viewHeight);
+	particles.setOpenBoundary(!scene.walls);
+	if (scene.fitView && scene.damParticles > 0) {
+		fitViewToParticles(particles, scene.damParticles);
+	}
+	if (scene.damParticles > 0) {
+		initSPH(particles, scene.damParticles);
+	}
+	for (const FluidBlock& block : scene.blocks) {
+		spawnFluidBlock(particles, block);
+	}
+}
+
+#endif
@@ -0,0 +1,569 @@
+#ifndef SIMD_KERNELS_H
+#define SIMD_KERNELS_H
+
+#include "Constants.h"
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Density and force sums over one span of candidate neighbors, in a scalar version and explicitly vectorized
+// AVX2 and AVX-512 versions for both precisions (4/8 candidates per instruction in double, 8/16 in float).
+// The instruction set is picked at runtime, so one binary uses AVX-512 where the CPU has it and still runs elsewhere.
+// The scalar version works with any smoothing kernel family (SmoothingKernels.h), the vectorized ones are written
+// for MullerKernels, the family the solver ships with. Builds with another family run the scalar version on every
+// instruction set.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FLUIDSIM_X86_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define FLUIDSIM_TARGET_AVX2
+#define FLUIDSIM_TARGET_AVX512
+#else
+#define FLUIDSIM_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define FLUIDSIM_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#endif
+#else
+#define FLUIDSIM_X86_SIMD 0
+#endif
+
+enum class SimdIsa { Scalar, AVX2, AVX512 };
+
+inline const char* simdIsaName(SimdIsa isa)
+{
+	switch (isa) {
+	case SimdIsa::AVX2: return "avx2";
+	case SimdIsa::AVX512: return "avx512";
+	default: return "scalar";
+	}
+}
+
+// Parses "scalar", "avx2" or "avx512", returns false for anything else
+inline bool parseSimdIsa(const std::string& name, SimdIsa& isa)
+{
+	if (name == "scalar") { isa = SimdIsa::Scalar; return true; }
+	if (name == "avx2") { isa = SimdIsa::AVX2; return true; }
+	if (name == "avx512") { isa = SimdIsa::AVX512; return true; }
+	return false;
+}
+
+// Returns true if the CPU (and OS) can run the given instruction set
+inline bool simdIsaSupported(SimdIsa isa)
+{
+	if (isa == SimdIsa::Scalar) {
+		return true;
+	}
+#if FLUIDSIM_X86_SIMD
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool fma = (info[2] & (1 << 12)) != 0;
+	if (!osxsave) {
+		return false;
+	}
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	bool avx2 = fma && (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+	bool avx512 = avx2 && (info[1] & (1 << 16)) != 0 && (xcr0 & 0xE6) == 0xE6;
+#else
+	__builtin_cpu_init();
+	bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	bool avx512 = avx2 && __builtin_cpu_supports("avx512f");
+#endif
+	return isa == SimdIsa::AVX2 ? avx2 : avx512;
+#else
+	return false;
+#endif
+}
+
+// Widest instruction set the CPU supports
+inline SimdIsa detectSimdIsa()
+{
+	if (simdIsaSupported(SimdIsa::AVX512)) return SimdIsa::AVX512;
+	if (simdIsaSupported(SimdIsa::AVX2)) return SimdIsa::AVX2;
+	return SimdIsa::Scalar;
+}
+
+// Number of set bits in a lane mask
+inline unsigned countLanes(unsigned mask)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	return __popcnt(mask);
+#else
+	return static_cast<unsigned>(__builtin_popcount(mask));
+#endif
+}
+
+// Particle fields the force sum reads
+template<typename Scalar>
+struct KernelFields {
+	const Scalar* x;
+	const Scalar* y;
+	const Scalar* vx;
+	const Scalar* vy;
+	const Scalar* rho;
+	const Scalar* p;
+};
+
+// density() returns the sum of the density kernel's shape over the candidates within H, still to be scaled by
+// mass * wDensity, and adds the number of candidates within H to accepted.
+// force() adds the pressure and viscosity force on particle i from the candidates within H to fx, fy.
+template<SimdIsa Isa, typename Scalar, typename Kernel = SmoothingKernel>
+struct SphKernels;
+
+template<typename Scalar, typename Kernel>
+struct SphKernels<SimdIsa::Scalar, Scalar, Kernel> {
+	static const SimdIsa Isa = SimdIsa::Scalar; // Instruction set the loops are written for
+	static Scalar density(Scalar xi, Scalar yi, const uint32_t* idx, size_t n, const Scalar* x, const Scalar* y, const SphParameters<Scalar>& c, size_t& accepted)
+	{
+		const Scalar h = c.h, hsq = c.hsq;
+		Scalar sum = 0.0f;
+		for (size_t k = 0; k < n; ++k)
+		{
+			size_t j = idx[k];
+			Scalar rx = x[j] - xi;
+			Scalar ry = y[j] - yi;
+			Scalar r2 = rx * rx + ry * ry;
+
+			if (r2 < hsq) { // Use squared distance for efficiency
+				sum += Kernel::density(r2, h, hsq);
+				accepted++;
+			}
+		}
+		return sum;
+	}
+
+	static void force(size_t i, const uint32_t* idx, size_t n, const KernelFields<Scalar>& f, const SphParameters<Scalar>& c, Scalar& fx, Scalar& fy)
+	{
+		// Local copies, so writing fx, fy doesn't make the compiler reload them
+		const Scalar hsq = c.hsq, h = c.h, mass = c.mass, viscosity = c.viscosity;
+		const Scalar wGradient = c.wGradient, wLaplacian = c.wLaplacian;
+		Scalar xi = f.x[i], yi = f.y[i];
+		for (size_t k = 0; k < n; ++k)
+		{
+			size_t j = idx[k];
+			if (i == j) continue;
+
+			Scalar rx = f.x[j] - xi;
+			Scalar ry = f.y[j] - yi;
+			Scalar r2 = rx * rx + ry * ry;
+
+			if (r2 < hsq) { // Only compute sqrt if within influence radius
+				Scalar r = std::sqrt(r2); // Now only computed when necessary
+
+				// pressure force along -rij.normalized() (zero for coincident particles, like Eigen)
+				Scalar pressureScale = r > 0 ? -mass * (f.p[i] + f.p[j]) /
+					(2 * f.rho[j]) * wGradient * Kernel::gradient(r, h) : 0;
+
+				// viscosity force
+				Scalar viscosityScale = viscosity * mass / f.rho[j] * wLaplacian * Kernel::laplacian(r, h);
+
+				fx += pressureScale * rx + viscosityScale * (f.vx[j] - f.vx[i]);
+				fy += pressureScale * ry + viscosityScale * (f.vy[j] - f.vy[i]);
+			}
+		}
+	}
+};
+
+// Instruction sets without vectorized loops for a kernel family run the scalar ones
+template<SimdIsa Isa, typename Scalar, typename Kernel>
+struct SphKernels : SphKernels<SimdIsa::Scalar, Scalar, Kernel> {};
+
+#if FLUIDSIM_X86_SIMD
+
+template<>
+struct SphKernels<SimdIsa::AVX2, double, MullerKernels> {
+	static const SimdIsa Isa = SimdIsa::AVX2;
+
+	// Loads up to 4 candidate indices, padding the tail with pad so every gather address stays valid
+	FLUIDSIM_TARGET_AVX2 static __m128i loadIndices(const uint32_t* idx, size_t count, uint32_t pad)
+	{
+		if (count >= 4) {
+			return _mm_loadu_si128(reinterpret_cast<const __m128i*>(idx));
+		}
+		uint32_t lanes[4] = { pad, pad, pad, pad };
+		std::memcpy(lanes, idx, count * sizeof(uint32_t));
+		return _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes));
+	}
+
+	// All-ones in the first count lanes
+	FLUIDSIM_TARGET_AVX2 static __m256d laneMask(size_t count)
+	{
+		__m256d lane = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+		return _mm256_cmp_pd(lane, _mm256_set1_pd(static_cast<double>(count)), _CMP_LT_OQ);
+	}
+
+	FLUIDSIM_TARGET_AVX2 static double horizontalSum(__m256d v)
+	{
+		__m128d sum = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+		return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+	}
+
+	FLUIDSIM_TARGET_AVX2 static double density(double xi, double yi, const uint32_t* idx, size_t n, const double* x, const double* y, const SphParameters<double>& c, size_t& accepted)
+	{
+		const __m256d hsq = _mm256_set1_pd(c.hsq);
+		const __m256d vxi = _mm256_set1_pd(xi), vyi = _mm256_set1_pd(yi);
+		__m256d sum = _mm256_setzero_pd();
+
+		for (size_t k = 0; k < n; k += 4) {
+			size_t count = n - k < 4 ? n - k : 4;
+			__m128i j = loadIndices(idx + k, count, idx[0]);
+			__m256d rx = _mm256_sub_pd(_mm256_i32gather_pd(x, j, 8), vxi);
+			__m256d ry = _mm256_sub_pd(_mm256_i32gather_pd(y, j, 8), vyi);
+			__m256d r2 = _mm256_fmadd_pd(rx, rx, _mm256_mul_pd(ry, ry));
+
+			__m256d inside = _mm256_and_pd(_mm256_cmp_pd(r2, hsq, _CMP_LT_OQ), laneMask(count));
+			accepted += countLanes(static_cast<unsigned>(_mm256_movemask_pd(inside)));
+			__m256d t = _mm256_sub_pd(hsq, r2);
+			sum = _mm256_add_pd(sum, _mm256_and_pd(_mm256_mul_pd(_mm256_mul_pd(t, t), t), inside));
+		}
+		return horizontalSum(sum);
+	}
+
+	FLUIDSIM_TARGET_AVX2 static void force(size_t i, const uint32_t* idx, size_t n, const KernelFields<double>& f, const SphParameters<double>& c, double& fx, double& fy)
+	{
+		const __m256d hsq = _mm256_set1_pd(c.hsq), h = _mm256_set1_pd(c.h), zero = _mm256_setzero_pd();
+		const __m256d vxi = _mm256_set1_pd(f.x[i]), vyi = _mm256_set1_pd(f.y[i]);
+		const __m256d vvxi = _mm256_set1_pd(f.vx[i]), vvyi = _mm256_set1_pd(f.vy[i]);
+		const __m256d pi = _mm256_set1_pd(f.p[i]);
+		const __m256d pressureConst = _mm256_set1_pd(-c.mass * 0.5 * c.wGradient);
+		const __m256d viscosityConst = _mm256_set1_pd(c.viscosity * c.mass * c.wLaplacian);
+		const __m128i self = _mm_set1_epi32(static_cast<int>(i));
+		__m256d sumX = zero, sumY = zero;
+
+		for (size_t k = 0; k < n; k += 4) {
+			size_t count = n - k < 4 ? n - k : 4;
+			__m128i j = loadIndices(idx + k, count, static_cast<uint32_t>(i));
+			__m256d rx = _mm256_sub_pd(_mm256_i32gather_pd(f.x, j, 8), vxi);
+			__m256d ry = _mm256_sub_pd(_mm256_i32gather_pd(f.y, j, 8), vyi);
+			__m256d r2 = _mm256_fmadd_pd(rx, rx, _mm256_mul_pd(ry, ry));
+
+			// Candidates within H that aren't particle i (padding lanes hold i, so they drop out here too)
+			__m256d notSelf = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_xor_si128(_mm_cmpeq_epi32(j, self), _mm_set1_epi32(-1))));
+			__m256d inside = _mm256_and_pd(_mm256_cmp_pd(r2, hsq, _CMP_LT_OQ), notSelf);
+			if (_mm256_movemask_pd(inside) == 0) continue;
+
+			__m256d rhoj = _mm256_i32gather_pd(f.rho, j, 8);
+			__m256d pj = _mm256_i32gather_pd(f.p, j, 8);
+			__m256d dvx = _mm256_sub_pd(_mm256_i32gather_pd(f.vx, j, 8), vvxi);
+			__m256d dvy = _mm256_sub_pd(_mm256_i32gather_pd(f.vy, j, 8), vvyi);
+
+			__m256d dist = _mm256_sqrt_pd(r2);
+			__m256d hr = _mm256_sub_pd(h, dist);
+			__m256d invRho = _mm256_div_pd(_mm256_set1_pd(1.0), rhoj);
+
+			// pressure along -rij.normalized(), coincident particles give 0/0 and are masked out
+			__m256d pressureScale = _mm256_mul_pd(_mm256_mul_pd(pressureConst, _mm256_add_pd(pi, pj)),
+				_mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(hr, hr), _mm256_mul_pd(hr, invRho)), dist));
+			pressureScale = _mm256_and_pd(pressureScale, _mm256_cmp_pd(dist, zero, _CMP_GT_OQ));
+
+			// viscosity
+			__m256d viscosityScale = _mm256_mul_pd(viscosityConst, _mm256_mul_pd(hr, invRho));
+
+			__m256d termX = _mm256_fmadd_pd(pressureScale, rx, _mm256_mul_pd(viscosityScale, dvx));
+			__m256d termY = _mm256_fmadd_pd(pressureScale, ry, _mm256_mul_pd(viscosityScale, dvy));
+			sumX = _mm256_add_pd(sumX, _mm256_and_pd(termX, inside));
+			sumY = _mm256_add_pd(sumY, _mm256_and_pd(termY, inside));
+		}
+		fx += horizontalSum(sumX);
+		fy += horizontalSum(sumY);
+	}
+};
+
+template<>
+struct SphKernels<SimdIsa::AVX2, float, MullerKernels> {
+	static const SimdIsa Isa = SimdIsa::AVX2;
+
+	// Loads up to 8 candidate indices, padding the tail with pad so every gather address stays valid
+	FLUIDSIM_TARGET_AVX2 static __m256i loadIndices(const uint32_t* idx, size_t count, uint32_t pad)
+	{
+		if (count >= 8) {
+			return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(idx));
+		}
+		uint32_t lanes[8] = { pad, pad, pad, pad, pad, pad, pad, pad };
+		std::memcpy(lanes, idx, count * sizeof(uint32_t));
+		return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes));
+	}
+
+	// All-ones in the first count lanes
+	FLUIDSIM_TARGET_AVX2 static __m256 laneMask(size_t count)
+	{
+		__m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(count)), lane));
+	}
+
+	FLUIDSIM_TARGET_AVX2 static float horizontalSum(__m256 v)
+	{
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		return _mm_cvtss_f32(_mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1)));
+	}
+
+	FLUIDSIM_TARGET_AVX2 static float density(float xi, float yi, const uint32_t* idx, size_t n, const float* x, const float* y, const SphParameters<float>& c, size_t& accepted)
+	{
+		const __m256 hsq = _mm256_set1_ps(c.hsq);
+		const __m256 vxi = _mm256_set1_ps(xi), vyi = _mm256_set1_ps(yi);
+		__m256 sum = _mm256_setzero_ps();
+
+		for (size_t k = 0; k < n; k += 8) {
+			size_t count = n - k < 8 ? n - k : 8;
+			__m256i j = loadIndices(idx + k, count, idx[0]);
+			__m256 rx = _mm256_sub_ps(_mm256_i32gather_ps(x, j, 4), vxi);
+			__m256 ry = _mm256_sub_ps(_mm256_i32gather_ps(y, j, 4), vyi);
+			__m256 r2 = _mm256_fmadd_ps(rx, rx, _mm256_mul_ps(ry, ry));
+
+			__m256 inside = _mm256_and_ps(_mm256_cmp_ps(r2, hsq, _CMP_LT_OQ), laneMask(count));
+			accepted += countLanes(static_cast<unsigned>(_mm256_movemask_ps(inside)));
+			__m256 t = _mm256_sub_ps(hsq, r2);
+			sum = _mm256_add_ps(sum, _mm256_and_ps(_mm256_mul_ps(_mm256_mul_ps(t, t), t), inside));
+		}
+		return horizontalSum(sum);
+	}
+
+	FLUIDSIM_TARGET_AVX2 static void force(size_t i, const uint32_t* idx, size_t n, const KernelFields<float>& f, const SphParameters<float>& c, float& fx, float& fy)
+	{
+		const __m256 hsq = _mm256_set1_ps(c.hsq), h = _mm256_set1_ps(c.h), zero = _mm256_setzero_ps();
+		const __m256 vxi = _mm256_set1_ps(f.x[i]), vyi = _mm256_set1_ps(f.y[i]);
+		const __m256 vvxi = _mm256_set1_ps(f.vx[i]), vvyi = _mm256_set1_ps(f.vy[i]);
+		const __m256 pi = _mm256_set1_ps(f.p[i]);
+		const __m256 pressureConst = _mm256_set1_ps(-c.mass * 0.5f * c.wGradient);
+		const __m256 viscosityConst = _mm256_set1_ps(c.viscosity * c.mass * c.wLaplacian);
+		const __m256i self = _mm256_set1_epi32(static_cast<int>(i));
+		__m256 sumX = zero, sumY = zero;
+
+		for (size_t k = 0; k < n; k += 8) {
+			size_t count = n - k < 8 ? n - k : 8;
+			__m256i j = loadIndices(idx + k, count, static_cast<uint32_t>(i));
+			__m256 rx = _mm256_sub_ps(_mm256_i32gather_ps(f.x, j, 4), vxi);
+			__m256 ry = _mm256_sub_ps(_mm256_i32gather_ps(f.y, j, 4), vyi);
+			__m256 r2 = _mm256_fmadd_ps(rx, rx, _mm256_mul_ps(ry, ry));
+
+			// Candidates within H that aren't particle i (padding lanes hold i, so they drop out here too)
+			__m256 notSelf = _mm256_castsi256_ps(_mm256_xor_si256(_mm256_cmpeq_epi32(j, self), _mm256_set1_epi32(-1)));
+			__m256 inside = _mm256_and_ps(_mm256_cmp_ps(r2, hsq, _CMP_LT_OQ), notSelf);
+			if (_mm256_movemask_ps(inside) == 0) continue;
+
+			__m256 rhoj = _mm256_i32gather_ps(f.rho, j, 4);
+			__m256 pj = _mm256_i32gather_ps(f.p, j, 4);
+			__m256 dvx = _mm256_sub_ps(_mm256_i32gather_ps(f.vx, j, 4), vvxi);
+			__m256 dvy = _mm256_sub_ps(_mm256_i32gather_ps(f.vy, j, 4), vvyi);
+
+			__m256 dist = _mm256_sqrt_ps(r2);
+			__m256 hr = _mm256_sub_ps(h, dist);
+			__m256 invRho = _mm256_div_ps(_mm256_set1_ps(1.0f), rhoj);
+
+			// pressure along -rij.normalized(), coincident particles give 0/0 and are masked out
+			__m256 pressureScale = _mm256_mul_ps(_mm256_mul_ps(pressureConst, _mm256_add_ps(pi, pj)),
+				_mm256_div_ps(_mm256_mul_ps(_mm256_mul_ps(hr, hr), _mm256_mul_ps(hr, invRho)), dist));
+			pressureScale = _mm256_and_ps(pressureScale, _mm256_cmp_ps(dist, zero, _CMP_GT_OQ));
+
+			// viscosity
+			__m256 viscosityScale = _mm256_mul_ps(viscosityConst, _mm256_mul_ps(hr, invRho));
+
+			__m256 termX = _mm256_fmadd_ps(pressureScale, rx, _mm256_mul_ps(viscosityScale, dvx));
+			__m256 termY = _mm256_fmadd_ps(pressureScale, ry, _mm256_mul_ps(viscosityScale, dvy));
+			sumX = _mm256_add_ps(sumX, _mm256_and_ps(termX, inside));
+			sumY = _mm256_add_ps(sumY, _mm256_and_ps(termY, inside));
+		}
+		fx += horizontalSum(sumX);
+		fy += horizontalSum(sumY);
+	}
+};
+
+template<>
+struct SphKernels<SimdIsa::AVX512, double, MullerKernels> {
+	static const SimdIsa Isa = SimdIsa::AVX512;
+
+	// Loads up to 8 candidate indices, padding the tail with pad so every gather address stays valid
+	FLUIDSIM_TARGET_AVX512 static __m256i loadIndices(const uint32_t* idx, size_t count, uint32_t pad)
+	{
+		if (count >= 8) {
+			return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(idx));
+		}
+		uint32_t lanes[8] = { pad, pad, pad, pad, pad, pad, pad, pad };
+		std::memcpy(lanes, idx, count * sizeof(uint32_t));
+		return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lanes));
+	}
+
+	FLUIDSIM_TARGET_AVX512 static double density(double xi, double yi, const uint32_t* idx, size_t n, const double* x, const double* y, const SphParameters<double>& c, size_t& accepted)
+	{
+		const __m512d hsq = _mm512_set1_pd(c.hsq);
+		const __m512d vxi = _mm512_set1_pd(xi), vyi = _mm512_set1_pd(yi);
+		__m512d sum = _mm512_setzero_pd();
+
+		for (size_t k = 0; k < n; k += 8) {
+			size_t count = n - k < 8 ? n - k : 8;
+			__mmask8 lanes = static_cast<__mmask8>((1u << count) - 1);
+			__m256i j = loadIndices(idx + k, count, idx[0]);
+			__m512d rx = _mm512_sub_pd(_mm512_i32gather_pd(j, x, 8), vxi);
+			__m512d ry = _mm512_sub_pd(_mm512_i32gather_pd(j, y, 8), vyi);
+			__m512d r2 = _mm512_fmadd_pd(rx, rx, _mm512_mul_pd(ry, ry));
+
+			__mmask8 inside = _mm512_mask_cmp_pd_mask(lanes, r2, hsq, _CMP_LT_OQ);
+			accepted += countLanes(inside);
+			__m512d t = _mm512_sub_pd(hsq, r2);
+			sum = _mm512_mask_add_pd(sum, inside, sum, _mm512_mul_pd(_mm512_mul_pd(t, t), t));
+		}
+		return _mm512_reduce_add_pd(sum);
+	}
+
+	FLUIDSIM_TARGET_AVX512 static void force(size_t i, const uint32_t* idx, size_t n, const KernelFields<double>& f, const SphParameters<double>& c, double& fx, double& fy)
+	{
+		const __m512d hsq = _mm512_set1_pd(c.hsq), h = _mm512_set1_pd(c.h), zero = _mm512_setzero_pd();
+		const __m512d vxi = _mm512_set1_pd(f.x[i]), vyi = _mm512_set1_pd(f.y[i]);
+		const __m512d vvxi = _mm512_set1_pd(f.vx[i]), vvyi = _mm512_set1_pd(f.vy[i]);
+		const __m512d pi = _mm512_set1_pd(f.p[i]);
+		const __m512d pressureConst = _mm512_set1_pd(-c.mass * 0.5 * c.wGradient);
+		const __m512d viscosityConst = _mm512_set1_pd(c.viscosity * c.mass * c.wLaplacian);
+		const __m512i self = _mm512_set1_epi64(static_cast<long long>(i));
+		__m512d sumX = zero, sumY = zero;
+
+		for (size_t k = 0; k < n; k += 8) {
+			size_t count = n - k < 8 ? n - k : 8;
+			__mmask8 lanes = static_cast<__mmask8>((1u << count) - 1);
+			__m256i j = loadIndices(idx + k, count, static_cast<uint32_t>(i));
+			__m512d rx = _mm512_sub_pd(_mm512_i32gather_pd(j, f.x, 8), vxi);
+			__m512d ry = _mm512_sub_pd(_mm512_i32gather_pd(j, f.y, 8), vyi);
+			__m512d r2 = _mm512_fmadd_pd(rx, rx, _mm512_mul_pd(ry, ry));
+
+			// Candidates within H that aren't particle i
+			__mmask8 notSelf = _mm512_cmpneq_epi64_mask(_mm512_cvtepu32_epi64(j), self);
+			__mmask8 inside = _mm512_mask_cmp_pd_mask(lanes & notSelf, r2, hsq, _CMP_LT_OQ);
+			if (inside == 0) continue;
+
+			__m512d rhoj = _mm512_i32gather_pd(j, f.rho, 8);
+			__m512d pj = _mm512_i32gather_pd(j, f.p, 8);
+			__m512d dvx = _mm512_sub_pd(_mm512_i32gather_pd(j, f.vx, 8), vvxi);
+			__m512d dvy = _mm512_sub_pd(_mm512_i32gather_pd(j, f.vy, 8), vvyi);
+
+			__m512d dist = _mm512_sqrt_pd(r2);
+			__m512d hr = _mm512_sub_pd(h, dist);
+			__m512d invRho = _mm512_div_pd(_mm512_set1_pd(1.0), rhoj);
+
+			// pressure along -rij.normalized(), zero for coincident particles
+			__mmask8 apart = _mm512_mask_cmp_pd_mask(inside, dist, zero, _CMP_GT_OQ);
+			__m512d pressureScale = _mm512_maskz_mul_pd(apart, _mm512_mul_pd(pressureConst, _mm512_add_pd(pi, pj)),
+				_mm512_div_pd(_mm512_mul_pd(_mm512_mul_pd(hr, hr), _mm512_mul_pd(hr, invRho)), dist));
+
+			// viscosity
+			__m512d viscosityScale = _mm512_mul_pd(viscosityConst, _mm512_mul_pd(hr, invRho));
+
+			__m512d termX = _mm512_fmadd_pd(pressureScale, rx, _mm512_mul_pd(viscosityScale, dvx));
+			__m512d termY = _mm512_fmadd_pd(pressureScale, ry, _mm512_mul_pd(viscosityScale, dvy));
+			sumX = _mm512_mask_add_pd(sumX, inside, sumX, termX);
+			sumY = _mm512_mask_add_pd(sumY, inside, sumY, termY);
+		}
+		fx += _mm512_reduce_add_pd(sumX);
+		fy += _mm512_reduce_add_pd(sumY);
+	}
+};
+
+template<>
+struct SphKernels<SimdIsa::AVX512, float, MullerKernels> {
+	static const SimdIsa Isa = SimdIsa::AVX512;
+
+	// Loads up to 16 candidate indices, padding the tail with pad so every gather address stays valid
+	FLUIDSIM_TARGET_AVX512 static __m512i loadIndices(const uint32_t* idx, size_t count, uint32_t pad)
+	{
+		if (count >= 16) {
+			return _mm512_loadu_si512(idx);
+		}
+		__mmask16 lanes = static_cast<__mmask16>((1u << count) - 1);
+		return _mm512_mask_loadu_epi32(_mm512_set1_epi32(static_cast<int>(pad)), lanes, idx);
+	}
+
+	FLUIDSIM_TARGET_AVX512 static float density(float xi, float yi, const uint32_t* idx, size_t n, const float* x, const float* y, const SphParameters<float>& c, size_t& accepted)
+	{
+		const __m512 hsq = _mm512_set1_ps(c.hsq);
+		const __m512 vxi = _mm512_set1_ps(xi), vyi = _mm512_set1_ps(yi);
+		__m512 sum = _mm512_setzero_ps();
+
+		for (size_t k = 0; k < n; k += 16) {
+			size_t count = n - k < 16 ? n - k : 16;
+			__mmask16 lanes = static_cast<__mmask16>((1u << count) - 1);
+			__m512i j = loadIndices(idx + k, count, idx[0]);
+			__m512 rx = _mm512_sub_ps(_mm512_i32gather_ps(j, x, 4), vxi);
+			__m512 ry = _mm512_sub_ps(_mm512_i32gather_ps(j, y, 4), vyi);
+			__m512 r2 = _mm512_fmadd_ps(rx, rx, _mm512_mul_ps(ry, ry));
+
+			__mmask16 inside = _mm512_mask_cmp_ps_mask(lanes, r2, hsq, _CMP_LT_OQ);
+			accepted += countLanes(inside);
+			__m512 t = _mm512_sub_ps(hsq, r2);
+			sum = _mm512_mask_add_ps(sum, inside, sum, _mm512_mul_ps(_mm512_mul_ps(t, t), t));
+		}
+		return _mm512_reduce_add_ps(sum);
+	}
+
+	FLUIDSIM_TARGET_AVX512 static void force(size_t i, const uint32_t* idx, size_t n, const KernelFields<float>& f, const SphParameters<float>& c, float& fx, float& fy)
+	{
+		const __m512 hsq = _mm512_set1_ps(c.hsq), h = _mm512_set1_ps(c.h), zero = _mm512_setzero_ps();
+		const __m512 vxi = _mm512_set1_ps(f.x[i]), vyi = _mm512_set1_ps(f.y[i]);
+		const __m512 vvxi = _mm512_set1_ps(f.vx[i]), vvyi = _mm512_set1_ps(f.vy[i]);
+		const __m512 pi = _mm512_set1_ps(f.p[i]);
+		const __m512 pressureConst = _mm512_set1_ps(-c.mass * 0.5f * c.wGradient);
+		const __m512 viscosityConst = _mm512_set1_ps(c.viscosity * c.mass * c.wLaplacian);
+		const __m512i self = _mm512_set1_epi32(static_cast<int>(i));
+		__m512 sumX = zero, sumY = zero;
+
+		for (size_t k = 0; k < n; k += 16) {
+			size_t count = n - k < 16 ? n - k : 16;
+			__mmask16 lanes = static_cast<__mmask16>((1u << count) - 1);
+			__m512i j = loadIndices(idx + k, count, static_cast<uint32_t>(i));
+			__m512 rx = _mm512_sub_ps(_mm512_i32gather_ps(j, f.x, 4), vxi);
+			__m512 ry = _mm512_sub_ps(_mm512_i32gather_ps(j, f.y, 4), vyi);
+			__m512 r2 = _mm512_fmadd_ps(rx, rx, _mm512_mul_ps(ry, ry));
+
+			// Candidates within H that aren't particle i
+			__mmask16 notSelf = _mm512_cmpneq_epi32_mask(j, self);
+			__mmask16 inside = _mm512_mask_cmp_ps_mask(lanes & notSelf, r2, hsq, _CMP_LT_OQ);
+			if (inside == 0) continue;
+
+			__m512 rhoj = _mm512_i32gather_ps(j, f.rho, 4);
+			__m512 pj = _mm512_i32gather_ps(j, f.p, 4);
+			__m512 dvx = _mm512_sub_ps(_mm512_i32gather_ps(j, f.vx, 4), vvxi);
+			__m512 dvy = _mm512_sub_ps(_mm512_i32gather_ps(j, f.vy, 4), vvyi);
+
+			__m512 dist = _mm512_sqrt_ps(r2);
+			__m512 hr = _mm512_sub_ps(h, dist);
+			__m512 invRho = _mm512_div_ps(_mm512_set1_ps(1.0f), rhoj);
+
+			// pressure along -rij.normalized(), zero for coincident particles
+			__mmask16 apart = _mm512_mask_cmp_ps_mask(inside, dist, zero, _CMP_GT_OQ);
+			__m512 pressureScale = _mm512_maskz_mul_ps(apart, _mm512_mul_ps(pressureConst, _mm512_add_ps(pi, pj)),
+				_mm512_div_ps(_mm512_mul_ps(_mm512_mul_ps(hr, hr), _mm512_mul_ps(hr, invRho)), dist));
+
+			// viscosity
+			__m512 viscosityScale = _mm512_mul_ps(viscosityConst, _mm512_mul_ps(hr, invRho));
+
+			__m512 termX = _mm512_fmadd_ps(pressureScale, rx, _mm512_mul_ps(viscosityScale, dvx));
+			__m512 termY = _mm512_fmadd_ps(pressureScale, ry, _mm512_mul_ps(viscosityScale, dvy));
+			sumX = _mm512_mask_add_ps(sumX, inside, sumX, termX);
+			sumY = _mm512_mask_add_ps(sumY, inside, sumY, termY);
+		}
+		fx += _mm512_reduce_add_ps(sumX);
+		fy += _mm512_reduce_add_ps(sumY);
+	}
+};
+
+#endif
+
+// Instruction set the kernels of a family run with when isa is asked for: Scalar unless it has vectorized loops
+template<typename Scalar, typename Kernel = SmoothingKernel>
+inline SimdIsa kernelSimdIsa(SimdIsa isa)
+{
+	switch (isa) {
+	case SimdIsa::AVX512: return SphKernels<SimdIsa::AVX512, Scalar, Kernel>::Isa;
+	case SimdIsa::AVX2: return SphKernels<SimdIsa::AVX2, Scalar, Kernel>::Isa;
+	default: return SimdIsa::Scalar;
+	}
+}
+
+#endif
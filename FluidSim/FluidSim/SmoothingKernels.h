@@ -0,0 +1,119 @@
+#ifndef SMOOTHING_KERNELS_H
+#define SMOOTHING_KERNELS_H
+
+#include <cmath>
+
+#ifndef M_PI
+# define M_PI           3.14159265358979323846
+#endif
+
+// Integer power that can be evaluated at compile time, unlike pow
+constexpr double constPow(double base, int exponent)
+{
+	double result = 1.0;
+	for (int i = 0; i < exponent; ++i) {
+		result *= base;
+	}
+	return result;
+}
+
+// Smoothing kernel families for 2D SPH, as policy types the solver is compiled against. Each family has:
+// - constexpr coefficients for kernel radius h, so a fixed h folds them into constants (SphConstants)
+// - the kernel shapes as plain polynomials in r (or r^2) and h, which inline into the neighbor loops:
+//   density(r2, h, hsq): W(r), used for the density sum
+//   gradient(r, h): dW/dr / r, so that times (xj - xi, yj - yi) it is the gradient. Only called for 0 < r < h
+//   laplacian(r, h): the viscosity term's Laplacian
+//   each still to be multiplied by its coefficient.
+// Every kernel has support radius h. The family a build uses is SmoothingKernel below, picked per build target
+
+// The kernels of Mueller et al. 2003 the solver was written with: poly6 for density, spiky for the pressure
+// gradient and the viscosity kernel's Laplacian. Density only needs r^2, so it is evaluated without a sqrt
+struct MullerKernels {
+	static constexpr const char* Name = "muller";
+
+	static constexpr double densityCoefficient(double h) { return 4.0 / (M_PI * constPow(h, 8)); } // Eq. 20
+	static constexpr double gradientCoefficient(double h) { return -10.0 / (M_PI * constPow(h, 5)); } // Eq. 21
+	static constexpr double laplacianCoefficient(double h) { return 40.0 / (M_PI * constPow(h, 5)); } // Eq. 22
+
+	template<typename Scalar>
+	static Scalar density(Scalar r2, Scalar, Scalar hsq) {
+		Scalar t = hsq - r2;
+		return t * t * t;
+	}
+	template<typename Scalar>
+	static Scalar gradient(Scalar r, Scalar h) {
+		Scalar hr = h - r;
+		return hr * hr * hr / r;
+	}
+	template<typename Scalar>
+	static Scalar laplacian(Scalar r, Scalar h) { return h - r; }
+};
+
+// Cubic B-spline (Monaghan 1992), W = sigma * (1 - 6q^2 + 6q^3) for q = r / h <= 1/2 and sigma * 2(1 - q)^3
+// beyond, with sigma = 40 / (7 pi h^2). The Laplacian is approximated by -2 (dW/dr) / r, which unlike the exact
+// one is positive everywhere (Brookshaw 1985)
+struct CubicSplineKernel {
+	static constexpr const char* Name = "cubic-spline";
+
+	static constexpr double densityCoefficient(double h) { return 40.0 / (7.0 * M_PI * constPow(h, 5)); }
+	static constexpr double gradientCoefficient(double h) { return 240.0 / (7.0 * M_PI * constPow(h, 5)); }
+	static constexpr double laplacianCoefficient(double h) { return 480.0 / (7.0 * M_PI * constPow(h, 5)); }
+
+	template<typename Scalar>
+	static Scalar density(Scalar r2, Scalar h, Scalar hsq) {
+		Scalar r = std::sqrt(r2);
+		Scalar hr = h - r;
+		return 2 * r <= h ? h * hsq - 6 * r2 * hr : 2 * hr * hr * hr;
+	}
+	template<typename Scalar>
+	static Scalar gradient(Scalar r, Scalar h) {
+		Scalar hr = h - r;
+		return 2 * r <= h ? 3 * r - 2 * h : -hr * hr / r;
+	}
+	template<typename Scalar>
+	static Scalar laplacian(Scalar r, Scalar h) {
+		Scalar hr = h - r;
+		return 2 * r <= h ? 2 * h - 3 * r : hr * hr / r;
+	}
+};
+
+// Wendland C2 (Wendland 1995), W = sigma * (1 - q)^4 (1 + 4q) with sigma = 7 / (pi h^2). Its gradient over r
+// needs no division, and it doesn't let particles pair up under compression. The Laplacian is approximated like
+// the cubic spline's
+struct WendlandC2Kernel {
+	static constexpr const char* Name = "wendland-c2";
+
+	static constexpr double densityCoefficient(double h) { return 7.0 / (M_PI * constPow(h, 7)); }
+	static constexpr double gradientCoefficient(double h) { return -140.0 / (M_PI * constPow(h, 7)); }
+	static constexpr double laplacianCoefficient(double h) { return 280.0 / (M_PI * constPow(h, 7)); }
+
+	template<typename Scalar>
+	static Scalar density(Scalar r2, Scalar h, Scalar) {
+		Scalar r = std::sqrt(r2);
+		Scalar hr = h - r;
+		Scalar hr2 = hr * hr;
+		return hr2 * hr2 * (h + 4 * r);
+	}
+	template<typename Scalar>
+	static Scalar gradient(Scalar r, Scalar h) {
+		Scalar hr = h - r;
+		return hr * hr * hr;
+	}
+	template<typename Scalar>
+	static Scalar laplacian(Scalar r, Scalar h) {
+		Scalar hr = h - r;
+		return hr * hr * hr;
+	}
+};
+
+// Kernel family the solver is built with: Mueller et al. by default, FLUIDSIM_KERNEL_CUBIC_SPLINE or
+// FLUIDSIM_KERNEL_WENDLAND_C2 switch to the others
+#if defined(FLUIDSIM_KERNEL_CUBIC_SPLINE)
+typedef CubicSplineKernel SmoothingKernel;
+#elif defined(FLUIDSIM_KERNEL_WENDLAND_C2)
+typedef WendlandC2Kernel SmoothingKernel;
+#else
+typedef MullerKernels SmoothingKernel;
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef SPIN_BARRIER_H
+#define SPIN_BARRIER_H
+
+#include <atomic>
+#include <thread>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#define FLUIDSIM_CPU_RELAX() _mm_pause()
+#else
+#define FLUIDSIM_CPU_RELAX() ((void)0)
+#endif
+
+// Barrier for a fixed team of threads that spins instead of sleeping, so a thread arriving at it gets going again
+// within a few hundred cycles of the last one. After a while spinning it starts yielding, and a team larger than
+// the machine (more threads than cores) yields right away, so waiters don't burn the core the late thread needs
+class SpinBarrier {
+public:
+	explicit SpinBarrier(int threads = 1) { reset(threads); }
+
+	// Sets the team size, only while no thread is waiting
+	void reset(int threads) {
+		m_threads = threads;
+		m_arrived.store(0, std::memory_order_relaxed);
+		static const unsigned cores = std::thread::hardware_concurrency();
+		m_spinLimit = cores != 0 && static_cast<unsigned>(threads) > cores ? 0 : SpinsBeforeYield;
+	}
+	int getThreads() const { return m_threads; }
+
+	void wait() {
+		unsigned generation = m_generation.load(std::memory_order_acquire);
+		if (m_arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == m_threads) {
+			// Last one in releases the others
+			m_arrived.store(0, std::memory_order_relaxed);
+			m_generation.fetch_add(1, std::memory_order_release);
+			return;
+		}
+
+		int spins = 0;
+		while (m_generation.load(std::memory_order_acquire) == generation) {
+			if (spins++ < m_spinLimit) {
+				FLUIDSIM_CPU_RELAX();
+			}
+			else {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+private:
+	static const int SpinsBeforeYield = 4096;
+
+	int m_threads;
+	int m_spinLimit;
+	alignas(64) std::atomic<int> m_arrived{ 0 };
+	alignas(64) std::atomic<unsigned> m_generation{ 0 };
+};
+
+#endif
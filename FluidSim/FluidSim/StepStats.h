@@ -0,0 +1,268 @@
+#ifndef STEP_STATS_H
+#define STEP_STATS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <ostream>
+#include <vector>
+#include <omp.h>
+#include "Trace.h"
+
+// Built-in solver instrumentation: wall time per phase, neighbor candidates tested vs accepted (r2 < HSQ),
+// particles per grid cell and how evenly the OpenMP threads were loaded.
+// Collection is off by default, when on it costs a few clock reads per phase and thread.
+// With a TraceRecorder attached the same phase and per-thread chunk timings are also recorded as trace events.
+
+enum class SolverPhase { Update, BuildGrid, Densities, Forces, Integrate, Export, Count };
+
+inline const char* solverPhaseName(SolverPhase phase)
+{
+	switch (phase) {
+	case SolverPhase::Update: return "update";
+	case SolverPhase::BuildGrid: return "buildGrid";
+	case SolverPhase::Densities: return "calculateDensities";
+	case SolverPhase::Forces: return "calculateForces";
+	case SolverPhase::Integrate: return "Integrate";
+	case SolverPhase::Export: return "exportPositions";
+	default: return "unknown";
+	}
+}
+
+// Neighbor candidates one thread tested, and how many of them were within H
+struct NeighborCounts {
+	size_t tested = 0;
+	size_t accepted = 0;
+};
+
+class StepStats {
+public:
+	struct PhaseTiming {
+		size_t calls = 0;
+		double lastMs = 0.0, totalMs = 0.0, maxMs = 0.0;
+		double imbalance = 1.0; // Slowest thread's busy time over the mean in the last call, 1 is perfectly even
+		double meanMs() const { return calls ? totalMs / calls : 0.0; }
+	};
+
+	// Turns collection on or off, off by default
+	void setEnabled(bool enabled) {
+		m_enabled = enabled;
+		if (enabled) {
+			resizeThreads();
+		}
+	}
+	bool isEnabled() const { return m_enabled; }
+
+	// Writes report() to out every interval steps, 0 stops the reports. Turns collection on
+	void setReportInterval(size_t steps, std::ostream* out) {
+		m_reportInterval = steps;
+		m_reportOut = out;
+		setEnabled(true);
+	}
+
+	// Records phase and worker chunk events into trace as well, nullptr stops tracing. The recorder must outlive
+	// the stats or be detached first
+	void setTrace(TraceRecorder* trace) { m_trace = trace; }
+	TraceRecorder* getTrace() const { return m_trace; }
+
+	// Clears everything collected so far
+	void reset() {
+		for (PhaseTiming& timing : m_phases) {
+			timing = PhaseTiming();
+		}
+		m_steps = 0;
+		m_lastCounts = m_stepCounts = m_totalCounts = NeighborCounts();
+		m_gridCells = m_occupiedCells = m_maxPerCell = m_gridParticles = 0;
+		m_listBuilds = m_listReuses = 0;
+	}
+
+	// Phase timing, phases may nest (update encloses the others)
+	void beginPhase(SolverPhase phase) {
+		if (m_trace) {
+			m_traceStart[index(phase)] = omp_get_wtime();
+			m_activePhase[m_phaseDepth < MaxPhaseDepth ? m_phaseDepth : MaxPhaseDepth - 1] = phase;
+			m_phaseDepth++;
+		}
+		if (!m_enabled) return;
+		if (m_threads.size() < static_cast<size_t>(omp_get_max_threads())) {
+			resizeThreads();
+		}
+		m_phaseStart[index(phase)] = Clock::now();
+	}
+	void endPhase(SolverPhase phase) {
+		if (m_trace) {
+			m_trace->record(omp_get_thread_num(), solverPhaseName(phase), "phase", m_traceStart[index(phase)], omp_get_wtime());
+			m_phaseDepth = m_phaseDepth > 0 ? m_phaseDepth - 1 : 0;
+		}
+		if (!m_enabled) return;
+		PhaseTiming& timing = m_phases[index(phase)];
+		double ms = std::chrono::duration<double, std::milli>(Clock::now() - m_phaseStart[index(phase)]).count();
+		timing.calls++;
+		timing.lastMs = ms;
+		timing.totalMs += ms;
+		timing.maxMs = ms > timing.maxMs ? ms : timing.maxMs;
+
+		// Fold in what the threads recorded during the phase
+		double busyMax = 0.0, busyTotal = 0.0;
+		int busyThreads = 0;
+		for (ThreadSlot& slot : m_threads) {
+			if (slot.busy > 0.0) {
+				busyMax = slot.busy > busyMax ? slot.busy : busyMax;
+				busyTotal += slot.busy;
+				busyThreads++;
+			}
+			m_stepCounts.tested += slot.counts.tested;
+			m_stepCounts.accepted += slot.counts.accepted;
+			slot = ThreadSlot();
+		}
+		// Mean over the threads that did work in the phase, so a phase run on a smaller team isn't overstated
+		if (busyThreads > 0) {
+			timing.imbalance = busyMax * busyThreads / busyTotal;
+		}
+	}
+
+	// Whether per-block events are wanted, so loops only read the clock per block while tracing
+	bool isTracing() const { return m_trace != nullptr; }
+
+	// Trace-only record of one block of a scheduled loop, inside the thread's share. Blocks taken from another
+	// thread's run go under their own category, so stealing shows in the trace. Doesn't count towards busy time
+	void recordBlock(int thread, double begin, double end, size_t block, bool stolen) {
+		if (m_trace && m_phaseDepth > 0) {
+			SolverPhase phase = m_activePhase[(m_phaseDepth < MaxPhaseDepth ? m_phaseDepth : MaxPhaseDepth) - 1];
+			m_trace->record(thread, solverPhaseName(phase), stolen ? "stolen" : "block", begin, end, static_cast<int32_t>(block));
+		}
+	}
+
+	// Called by every thread at the end of its share of a parallel loop, with omp_get_wtime() times. chunk tells
+	// loops of the same phase apart in the trace (e.g. the cell color), -1 for none
+	void recordThread(int thread, double begin, double end, const NeighborCounts& counts, int chunk = -1) {
+		if (m_trace && m_phaseDepth > 0) {
+			SolverPhase phase = m_activePhase[(m_phaseDepth < MaxPhaseDepth ? m_phaseDepth : MaxPhaseDepth) - 1];
+			m_trace->record(thread, solverPhaseName(phase), "worker", begin, end, chunk);
+		}
+		if (!m_enabled || thread >= static_cast<int>(m_threads.size())) return;
+		ThreadSlot& slot = m_threads[thread];
+		slot.busy += end - begin;
+		slot.counts.tested += counts.tested;
+		slot.counts.accepted += counts.accepted;
+	}
+
+	// Grid occupancy after a rebuild
+	void recordGrid(size_t particles, size_t cells, size_t occupiedCells, size_t maxPerCell) {
+		m_gridParticles = particles;
+		m_gridCells = cells;
+		m_occupiedCells = occupiedCells;
+		m_maxPerCell = maxPerCell;
+	}
+
+	// Whether a grid build with neighbor lists rebuilt them or reused the previous ones
+	void recordNeighborLists(bool rebuilt) {
+		if (!m_enabled) return;
+		(rebuilt ? m_listBuilds : m_listReuses)++;
+	}
+
+	// Ends a solver step, and writes the periodic report when one is due
+	void endStep() {
+		if (!m_enabled) return;
+		m_steps++;
+		m_lastCounts = m_stepCounts;
+		m_totalCounts.tested += m_stepCounts.tested;
+		m_totalCounts.accepted += m_stepCounts.accepted;
+		m_stepCounts = NeighborCounts();
+		if (m_reportOut && m_reportInterval > 0 && m_steps % m_reportInterval == 0) {
+			report(*m_reportOut);
+		}
+	}
+
+	// Queries
+	const PhaseTiming& getPhase(SolverPhase phase) const { return m_phases[index(phase)]; }
+	size_t getSteps() const { return m_steps; }
+	const NeighborCounts& getLastStepCounts() const { return m_lastCounts; }
+	const NeighborCounts& getTotalCounts() const { return m_totalCounts; }
+	double getAcceptanceRatio() const {
+		return m_totalCounts.tested ? static_cast<double>(m_totalCounts.accepted) / m_totalCounts.tested : 0.0;
+	}
+	size_t getGridCells() const { return m_gridCells; }
+	size_t getOccupiedCells() const { return m_occupiedCells; }
+	size_t getMaxParticlesPerCell() const { return m_maxPerCell; }
+	size_t getNeighborListBuilds() const { return m_listBuilds; }
+	size_t getNeighborListReuses() const { return m_listReuses; }
+	double getParticlesPerCell() const { // Mean over occupied cells
+		return m_occupiedCells ? static_cast<double>(m_gridParticles) / m_occupiedCells : 0.0;
+	}
+
+	// Human readable summary of everything collected so far
+	void report(std::ostream& out) const {
+		char line[160];
+		out << "[stats] step " << m_steps << "\n";
+		std::snprintf(line, sizeof(line), "  %-20s %10s %10s %10s %10s\n", "phase", "last ms", "mean ms", "max ms", "imbalance");
+		out << line;
+		for (int p = 0; p < static_cast<int>(SolverPhase::Count); ++p) {
+			const PhaseTiming& timing = m_phases[p];
+			if (timing.calls == 0) continue;
+			std::snprintf(line, sizeof(line), "  %-20s %10.3f %10.3f %10.3f %10.2f\n", solverPhaseName(static_cast<SolverPhase>(p)),
+				timing.lastMs, timing.meanMs(), timing.maxMs, timing.imbalance);
+			out << line;
+		}
+		std::snprintf(line, sizeof(line), "  candidates: %zu tested, %zu accepted last step (%.1f%% accepted overall)\n",
+			m_lastCounts.tested, m_lastCounts.accepted, 100.0 * getAcceptanceRatio());
+		out << line;
+		std::snprintf(line, sizeof(line), "  grid: %.2f particles per occupied cell (max %zu), %zu of %zu cells occupied\n",
+			getParticlesPerCell(), m_maxPerCell, m_occupiedCells, m_gridCells);
+		out << line;
+		if (m_listBuilds + m_listReuses > 0) {
+			std::snprintf(line, sizeof(line), "  neighbor lists: reused on %zu of %zu steps (%.1f%%)\n",
+				m_listReuses, m_listBuilds + m_listReuses, 100.0 * m_listReuses / (m_listBuilds + m_listReuses));
+			out << line;
+		}
+		out.flush();
+	}
+
+	// Times the enclosing scope as the given phase
+	class ScopedPhase {
+	public:
+		ScopedPhase(StepStats& stats, SolverPhase phase) : m_stats(stats), m_phase(phase) { m_stats.beginPhase(phase); }
+		~ScopedPhase() { m_stats.endPhase(m_phase); }
+		ScopedPhase(const ScopedPhase&) = delete;
+		ScopedPhase& operator=(const ScopedPhase&) = delete;
+	private:
+		StepStats& m_stats;
+		SolverPhase m_phase;
+	};
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	// One cache line per thread so recording doesn't false-share
+	struct alignas(64) ThreadSlot {
+		double busy = 0.0; // seconds
+		NeighborCounts counts;
+	};
+
+	static int index(SolverPhase phase) { return static_cast<int>(phase); }
+
+	void resizeThreads() {
+		m_threads.assign(static_cast<size_t>(omp_get_max_threads()), ThreadSlot());
+	}
+
+	static const int MaxPhaseDepth = 4;
+
+	bool m_enabled = false;
+	TraceRecorder* m_trace = nullptr;
+	double m_traceStart[static_cast<int>(SolverPhase::Count)] = {};
+	SolverPhase m_activePhase[MaxPhaseDepth] = {}; // Innermost open phase last, worker chunks are named after it
+	int m_phaseDepth = 0;
+	size_t m_reportInterval = 0;
+	std::ostream* m_reportOut = nullptr;
+
+	PhaseTiming m_phases[static_cast<int>(SolverPhase::Count)];
+	Clock::time_point m_phaseStart[static_cast<int>(SolverPhase::Count)];
+	std::vector<ThreadSlot> m_threads;
+
+	size_t m_steps = 0;
+	NeighborCounts m_stepCounts, m_lastCounts, m_totalCounts;
+	size_t m_gridParticles = 0, m_gridCells = 0, m_occupiedCells = 0, m_maxPerCell = 0;
+	size_t m_listBuilds = 0, m_listReuses = 0;
+};
+
+#endif
@@ -0,0 +1,446 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "Checkpoint.h"
+#include "Constants.h"
+#include "Particles.h"
+#include "Scene.h"
+#include "SceneConfig.h"
+#include "Trajectory.h"
+
+// Regression checks run by ctest (see CMakeLists.txt), one per name
+//
+// Usage: fluidsim_tests NAME, without a name every check runs
+
+// Reports a failed condition, the check carries on so one run lists every failure
+#define CHECK(condition) check(condition, #condition, __FILE__, __LINE__)
+
+static bool check(bool condition, const char* text, const char* file, int line)
+{
+	if (!condition) {
+		std::cerr << file << ":" << line << ": check failed: " << text << std::endl;
+	}
+	return condition;
+}
+
+// The dam break scene every check starts from, the same particles on every run
+static void initTestScene(ParticleList& particles, size_t count)
+{
+	srand(1);
+	fitViewToParticles(particles, count);
+	initSPH(particles, count);
+}
+
+// The incremental grid update must leave exactly the cells a full counting sort builds
+static bool testIncrementalGrid()
+{
+	bool ok = true;
+	for (bool hashed : { false, true }) {
+		ParticleList incremental, full;
+		initTestScene(incremental, 2000);
+		initTestScene(full, 2000);
+		incremental.setHashGrid(hashed);
+		full.setHashGrid(hashed);
+		full.setIncrementalGrid(false);
+
+		bool same = true; // Stops at the first difference, the steps after it would only repeat it
+		for (int step = 0; step < 300 && same; ++step) {
+			incremental.step();
+			full.step();
+			const size_t cells = hashed ? full.getHashTableSize() : static_cast<size_t>(full.getGridWidth()) * full.getGridHeight();
+			same &= CHECK(incremental.getGridWidth() == full.getGridWidth() && incremental.getGridHeight() == full.getGridHeight());
+			same &= CHECK(incremental.getHashTableSize() == full.getHashTableSize());
+			same &= CHECK(std::equal(full.cellStart(), full.cellStart() + cells, incremental.cellStart()));
+			same &= CHECK(std::equal(full.cellEnd(), full.cellEnd() + cells, incremental.cellEnd()));
+			same &= CHECK(std::equal(full.cellParticles(), full.cellParticles() + full.size(), incremental.cellParticles()));
+		}
+		ok &= same;
+		ok &= CHECK(incremental.getGridUpdates() > 0); // Otherwise nothing above went through the update
+		ok &= CHECK(full.getGridUpdates() == 0);
+	}
+	return ok;
+}
+
+// Reads a whole file, empty if it can't be read
+static std::vector<char> readFile(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// True if count values of a and b have the same bytes
+template<typename T>
+static bool sameBits(const T* a, const T* b, size_t count)
+{
+	return std::memcmp(a, b, count * sizeof(T)) == 0;
+}
+
+// Every particle field and all of the run state must match bit for bit
+static bool sameState(ParticleList& a, ParticleList& b)
+{
+	bool ok = CHECK(a.size() == b.size());
+	if (!ok) {
+		return false;
+	}
+	const size_t n = a.size();
+	ok &= CHECK(sameBits(a.positionsX(), b.positionsX(), n) && sameBits(a.positionsY(), b.positionsY(), n));
+	ok &= CHECK(sameBits(a.velocitiesX(), b.velocitiesX(), n) && sameBits(a.velocitiesY(), b.velocitiesY(), n));
+	ok &= CHECK(sameBits(a.forcesX(), b.forcesX(), n) && sameBits(a.forcesY(), b.forcesY(), n));
+	ok &= CHECK(sameBits(a.densities(), b.densities(), n) && sameBits(a.pressures(), b.pressures(), n));
+	ok &= CHECK(sameBits(a.particleIds(), b.particleIds(), n));
+
+	ParticleList::RunState sa = a.getRunState(), sb = b.getRunState();
+	ok &= CHECK(sa.stepCount == sb.stepCount && sa.nextReorderStep == sb.nextReorderStep && sa.nextId == sb.nextId);
+	ok &= CHECK(sameBits(&sa.simulatedTime, &sb.simulatedTime, 1) && sameBits(&sa.dt, &sb.dt, 1));
+	ok &= CHECK(a.getViewWidth() == b.getViewWidth() && a.getViewHeight() == b.getViewHeight());
+	ok &= CHECK(a.getAdaptiveTimeStep() == b.getAdaptiveTimeStep() && a.getHashGrid() == b.getHashGrid());
+	ok &= CHECK(a.getOpenBoundary() == b.getOpenBoundary());
+	return ok;
+}
+
+// A checkpoint load must reproduce the saved state bit for bit, and so must the steps after it
+static bool testCheckpointRoundTrip()
+{
+	const std::string path = "fluidsim_tests_checkpoint.bin";
+	bool ok = true;
+	for (bool hashed : { false, true }) {
+		ParticleList saved, loaded;
+		initTestScene(saved, 2000);
+		saved.setAdaptiveTimeStep(true);
+		saved.setHashGrid(hashed);
+		saved.setOpenBoundary(hashed);
+		saved.setReorderInterval(7);
+		saved.advance(saved.getParameters().dt * 40);
+
+		std::string error;
+		ok &= CHECK(saveCheckpoint(saved, path));
+		ok &= CHECK(loadCheckpoint(loaded, path, error));
+		if (!error.empty()) {
+			std::cerr << error << std::endl;
+		}
+		ok &= sameState(saved, loaded);
+
+		loaded.setReorderInterval(saved.getReorderInterval()); // Not part of a checkpoint, the runner's option
+		for (int step = 0; step < 20; ++step) {
+			saved.step();
+			loaded.step();
+		}
+		ok &= sameState(saved, loaded);
+	}
+
+	// A truncated file is rejected rather than read past its end
+	std::vector<char> bytes = readFile(path);
+	std::ofstream(path, std::ios::binary | std::ios::trunc).write(bytes.data(), bytes.size() / 2);
+	ParticleList truncated;
+	std::string error;
+	ok &= CHECK(!bytes.empty() && !loadCheckpoint(truncated, path, error));
+	std::remove(path.c_str());
+	return ok;
+}
+
+// Rice coding must give back every value, including ones past the escape and a partial last block
+static bool testRiceRoundTrip()
+{
+	std::vector<uint64_t> values;
+	srand(2);
+	for (size_t i = 0; i < 1000; ++i) {
+		switch (i / 200) {
+		case 0: values.push_back(0); break; // All zero blocks
+		case 1: values.push_back(rand() % 16); break;
+		case 2: values.push_back(static_cast<uint64_t>(rand()) << (rand() % 32)); break;
+		case 3: values.push_back(i % 64 == 5 ? ~uint64_t(0) - i : rand() % 4); break; // Outliers among small values
+		default: values.push_back(zigzagEncode(static_cast<int64_t>(rand() % 2001) - 1000)); break;
+		}
+	}
+	values.resize(values.size() - 13); // Partial last block
+
+	std::vector<uint8_t> bytes;
+	RiceEncoder encoder(bytes);
+	encoder.encode(values.data(), values.size());
+	encoder.finish();
+	std::vector<uint64_t> decoded(values.size());
+	RiceDecoder decoder(bytes.data(), bytes.size());
+	bool ok = CHECK(decoder.decode(decoded.data(), decoded.size()));
+	ok &= CHECK(decoded == values);
+
+	// Data that runs out is reported, not read past
+	RiceDecoder truncated(bytes.data(), bytes.size() / 2);
+	ok &= CHECK(!truncated.decode(decoded.data(), decoded.size()));
+
+	for (int64_t value : { int64_t(0), int64_t(-1), int64_t(1), INT64_MIN, INT64_MAX }) {
+		ok &= CHECK(zigzagDecode(zigzagEncode(value)) == value);
+	}
+	return ok;
+}
+
+// A trajectory must read back every frame as the quantizer stored it, in any order, through the index and, for a
+// file that was never closed, by walking the frame headers
+static bool testTrajectoryRoundTrip()
+{
+	const std::string path = "fluidsim_tests_trajectory.bin";
+	const std::string unclosedPath = "fluidsim_tests_trajectory_unclosed.bin";
+	const size_t frames = 11;
+	ParticleList particles;
+	initTestScene(particles, 2000);
+	particles.setReorderInterval(3); // Frames are stored in id order whatever the particle order
+
+	TrajectoryOptions options;
+	options.framesPerChunk = 4;
+	TrajectoryWriter writer;
+	bool ok = CHECK(writer.open(path, particles, options));
+	const size_t count = particles.size();
+	std::vector<std::vector<Real>> stored(frames, std::vector<Real>(4 * count)); // x, y, vx, vy by id
+	std::vector<size_t> steps(frames);
+	for (size_t frame = 0; frame < frames; ++frame) {
+		for (int step = 0; step < 5; ++step) {
+			particles.step();
+		}
+		for (size_t i = 0; i < count; ++i) {
+			Real* values = stored[frame].data() + 4 * particles.getParticleId(i);
+			values[0] = particles.positionsX()[i];
+			values[1] = particles.positionsY()[i];
+			values[2] = particles.velocitiesX()[i];
+			values[3] = particles.velocitiesY()[i];
+		}
+		steps[frame] = particles.getStepCount();
+		ok &= CHECK(writer.addFrame(particles));
+	}
+	ok &= CHECK(writer.close());
+	ok &= CHECK(writer.getClamped() == 0 && writer.getDropped() == 0);
+
+	// The file without its index and footer, as a crashed run leaves it
+	std::vector<char> bytes = readFile(path);
+	TrajectoryFooter footer = {};
+	ok &= CHECK(bytes.size() > sizeof(footer));
+	if (bytes.size() > sizeof(footer)) {
+		std::memcpy(&footer, bytes.data() + bytes.size() - sizeof(footer), sizeof(footer));
+		ok &= CHECK(footer.frameCount == frames && footer.indexOffset < bytes.size());
+		std::ofstream(unclosedPath, std::ios::binary | std::ios::trunc).write(bytes.data(), std::min<size_t>(footer.indexOffset, bytes.size()));
+	}
+
+	// Backwards across chunks, forwards within one, a keyframe, then forwards across a keyframe
+	static const size_t order[] = { 10, 2, 3, 0, 7, 5, 6, 9, 1, 4, 8 };
+	for (const std::string& file : { path, unclosedPath }) {
+		TrajectoryReader reader;
+		std::string error;
+		if (!CHECK(reader.open(file, error))) {
+			std::cerr << error << std::endl;
+			ok = false;
+			continue;
+		}
+		ok &= CHECK(reader.getFrameCount() == frames && reader.getParticleCount() == count);
+		TrajectoryQuantizer quantizer(reader.getHeader());
+		std::vector<double> x(count), y(count), vx(count), vy(count);
+		for (size_t frame : order) {
+			if (!CHECK(frame < reader.getFrameCount() && reader.readFrame(frame, x.data(), y.data(), vx.data(), vy.data()))) {
+				ok = false;
+				break;
+			}
+			ok &= CHECK(reader.getFrameStep(frame) == steps[frame]);
+			bool same = true;
+			for (size_t id = 0; id < count; ++id) {
+				const Real* values = stored[frame].data() + 4 * id;
+				same &= x[id] == quantizer.x(quantizer.positionX(values[0])) && y[id] == quantizer.y(quantizer.positionY(values[1]));
+				same &= vx[id] == quantizer.v(quantizer.velocity(values[2])) && vy[id] == quantizer.v(quantizer.velocity(values[3]));
+			}
+			ok &= CHECK(same);
+		}
+	}
+	std::remove(path.c_str());
+	std::remove(unclosedPath.c_str());
+	return ok;
+}
+
+// Parses text as a scene file, returns false with "line N: reason" in error if the parser or the reader rejects it
+static bool parseScene(const std::string& text, SceneConfig& scene, std::string& error)
+{
+	JsonValue root;
+	scene = SceneConfig();
+	return JsonParser().parse(text, root, error) && SceneReader().read(root, scene, error);
+}
+
+// The scene parser must reject malformed JSON and scenes it can't run, with the line of the problem
+static bool testSceneParser()
+{
+	struct Case {
+		const char* text;
+		int line; // Expected in the error
+	};
+	static const Case malformed[] = {
+		{ "", 1 },
+		{ "{", 1 },
+		{ "{\n\"dam\": { \"particles\": 400 }", 2 },
+		{ "{ \"dam\" { \"particles\": 400 } }", 1 },
+		{ "{ dam: {} }", 1 },
+		{ "{ \"view\": {}, }", 1 },
+		{ "{ \"view\": {} } {}", 1 },
+		{ "{ \"view\": {}, \"view\": {} }", 1 },
+		{ "{ \"fluid\": [ { \"min\": [0, 0], \"max\": [1, 1] }, ] }", 1 },
+		{ "{ \"fluid\": [ { \"min\": [0, 0] \"max\": [1, 1] } ] }", 1 },
+		{ "{ \"view\": { \"walls\": tru } }", 1 },
+		{ "{ \"view\": { \"walls\": truex } }", 1 },
+		{ "{ \"view\": { \"walls\": nul } }", 1 },
+		{ "{\n\n\"parameters\": { \"h\": 1.2.3 } }", 3 },
+		{ "{ \"parameters\": { \"h\": +16 } }", 1 },
+		{ "{ \"parameters\": { \"h\": 0x10 } }", 1 },
+		{ "{ \"parameters\": { \"h\": - } }", 1 },
+		{ "{ \"parameters\": { \"h\": 1e } }", 1 },
+		{ "{ \"parameters\": { \"h\": 016 } }", 1 },
+		{ "{ \"parameters\": { \"h\": 16. } }", 1 },
+		{ "{ \"parameters\": { \"h\": -.5 } }", 1 },
+		{ "{ \"parameters\": { \"h\": 1.e3 } }", 1 },
+		{ "{ \"parameters\": { \"h\": inf } }", 1 },
+		{ "{ \"parameters\": { \"h\": NaN } }", 1 },
+		{ "{ \"view\": { \"width\": \"800 } }", 1 },
+		{ "{ \"view\": { \"width\": \"8\\q\" } }", 1 },
+		{ "{ \"view\": { \"width\": \"8\n00\" } }", 1 },
+		{ "[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]", 1 },
+		// Valid JSON, but not a scene that can run
+		{ "[]", 1 },
+		{ "{ \"paramters\": {} }", 1 },
+		{ "{\n\"parameters\": {\n\"h\": -16 } }", 3 },
+		{ "{ \"parameters\": { \"gravity\": [0] } }", 1 },
+		{ "{ \"view\": { \"width\": \"800\" } }", 1 },
+		{ "{ \"dam\": { \"particles\": 1.5 } }", 1 },
+		{ "{ \"fluid\": [ { \"min\": [0, 0] } ] }", 1 },
+		{ "{ \"fluid\": [ { \"min\": [10, 10], \"max\": [0, 0] } ] }", 1 },
+	};
+
+	bool ok = true;
+	for (const Case& c : malformed) {
+		SceneConfig scene;
+		std::string error;
+		const std::string line = "line " + std::to_string(c.line) + ":";
+		if (!CHECK(!parseScene(c.text, scene, error) && error.compare(0, line.size(), line) == 0)) {
+			std::cerr << "  accepted or misplaced: " << c.text << " (" << error << ")" << std::endl;
+			ok = false;
+		}
+	}
+
+	// And still read a valid one
+	SceneConfig scene;
+	std::string error;
+	ok &= CHECK(parseScene("{ \"parameters\": { \"h\": 12.5, \"gravity\": [0, -1e1] }, \"view\": { \"walls\": false },\n"
+		"  \"fluid\": [ { \"min\": [0, 0], \"max\": [100, 50], \"spacing\": 10 } ] }", scene, error));
+	ok &= CHECK(scene.parameters.h == 12.5 && scene.parameters.gy == -10.0 && !scene.walls);
+	ok &= CHECK(scene.blocks.size() == 1 && scene.blocks[0].maxY == 50.0 && scene.damParticles == 0);
+	return ok;
+}
+
+// Copies the particles of a float or double list into a list of the other precision
+template<typename Scalar>
+static void copyScene(ParticleList& from, BasicParticleList<Scalar>& to)
+{
+	to.setView(from.getViewWidth(), from.getViewHeight());
+	to.resizeParticles(from.size());
+	for (size_t i = 0; i < from.size(); ++i) {
+		to.positionsX()[i] = static_cast<Scalar>(from.positionsX()[i]);
+		to.positionsY()[i] = static_cast<Scalar>(from.positionsY()[i]);
+		to.velocitiesX()[i] = static_cast<Scalar>(from.velocitiesX()[i]);
+		to.velocitiesY()[i] = static_cast<Scalar>(from.velocitiesY()[i]);
+	}
+}
+
+// Runs the density and force passes on the same particles with the scalar kernels and with isa, and compares.
+// Densities and pressures must agree to within tolerance of their value, forces to within tolerance of the largest
+// force in the scene, since a particle's net force can be a small difference of large neighbor terms
+template<typename Scalar>
+static bool compareKernels(ParticleList& scene, SimdIsa isa, double tolerance)
+{
+	BasicParticleList<Scalar> reference, vector;
+	copyScene(scene, reference);
+	copyScene(scene, vector);
+	bool ok = CHECK(reference.setSimdIsa(SimdIsa::Scalar) && vector.setSimdIsa(isa));
+	ok &= CHECK(vector.getActiveSimdIsa() == isa); // Else this compares the scalar loops with themselves
+	for (BasicParticleList<Scalar>* particles : { &reference, &vector }) {
+		particles->buildGrid();
+		particles->calculateDensities();
+		particles->calculateForces();
+	}
+
+	const size_t n = reference.size();
+	double maxForce = 0.0;
+	for (size_t i = 0; i < n; ++i) {
+		maxForce = std::max(maxForce, static_cast<double>(std::hypot(reference.forcesX()[i], reference.forcesY()[i])));
+	}
+	double densityError = 0.0, pressureError = 0.0, forceError = 0.0;
+	for (size_t i = 0; i < n; ++i) {
+		auto relative = [](double a, double b) { return std::fabs(a - b) / std::max(std::fabs(a), 1e-30); };
+		densityError = std::max(densityError, relative(reference.densities()[i], vector.densities()[i]));
+		pressureError = std::max(pressureError, relative(reference.pressures()[i], vector.pressures()[i]));
+		double dfx = static_cast<double>(reference.forcesX()[i]) - vector.forcesX()[i];
+		double dfy = static_cast<double>(reference.forcesY()[i]) - vector.forcesY()[i];
+		forceError = std::max(forceError, std::hypot(dfx, dfy) / maxForce);
+	}
+	std::cout << "  " << simdIsaName(isa) << (sizeof(Scalar) == 4 ? " float" : " double") << ": density " << densityError
+		<< ", pressure " << pressureError << ", force " << forceError << " (tolerance " << tolerance << ")" << std::endl;
+	ok &= CHECK(maxForce > 0.0);
+	ok &= CHECK(densityError <= tolerance && pressureError <= tolerance && forceError <= tolerance);
+	return ok;
+}
+
+// The AVX2 and AVX-512 kernels must match the scalar ones, in both precisions, on every instruction set this CPU has
+static bool testSimdKernels()
+{
+	ParticleList scene;
+	initTestScene(scene, 2000);
+	for (int step = 0; step < 200; ++step) {
+		scene.step(); // Let the dam collapse, so there are velocities and compressed regions
+	}
+
+	bool ok = true;
+	for (SimdIsa isa : { SimdIsa::AVX2, SimdIsa::AVX512 }) {
+		if (!simdIsaSupported(isa)) {
+			std::cout << "  " << simdIsaName(isa) << ": not supported here, skipped" << std::endl;
+			continue;
+		}
+		// About 30 and 1000 times the differences summation order makes on this scene
+		ok &= compareKernels<float>(scene, isa, 1e-5);
+		ok &= compareKernels<double>(scene, isa, 1e-12);
+	}
+	return ok;
+}
+
+struct TestCase {
+	const char* name;
+	bool (*run)();
+};
+
+static const TestCase Tests[] = {
+	{ "incremental_grid", testIncrementalGrid },
+	{ "checkpoint_round_trip", testCheckpointRoundTrip },
+	{ "rice_round_trip", testRiceRoundTrip },
+	{ "trajectory_round_trip", testTrajectoryRoundTrip },
+	{ "scene_parser", testSceneParser },
+	{ "simd_kernels", testSimdKernels },
+};
+
+int main(int argc, char** argv)
+{
+	if (argc > 2) {
+		std::cerr << "Usage: " << argv[0] << " [NAME]" << std::endl;
+		return 2;
+	}
+	bool found = false, ok = true;
+	for (const TestCase& test : Tests) {
+		if (argc == 2 && std::strcmp(argv[1], test.name) != 0) {
+			continue;
+		}
+		found = true;
+		bool passed = test.run();
+		std::cout << test.name << ": " << (passed ? "passed" : "FAILED") << std::endl;
+		ok &= passed;
+	}
+	if (!found) {
+		std::cerr << "No check named " << argv[1] << std::endl;
+		return 2;
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,116 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+// Records begin/end events of solver phases and OpenMP worker chunks, and writes them as a Chrome trace-event
+// JSON file (open it in chrome://tracing or ui.perfetto.dev).
+// Every thread writes only to its own fixed-size ring buffer, so recording takes no locks and never allocates.
+// Once a ring is full its oldest events are overwritten, so the file holds the most recent steps.
+
+struct TraceEvent {
+	const char* name; // Must outlive the recorder, in practice a string literal
+	const char* category;
+	double begin, end; // omp_get_wtime() seconds
+	int32_t arg; // Shown as args.index, -1 for none
+};
+
+class TraceRecorder {
+public:
+	// eventsPerThread is rounded up to a power of two
+	explicit TraceRecorder(size_t eventsPerThread = size_t(1) << 16, int threads = omp_get_max_threads())
+		: m_threadCount(threads > 0 ? threads : 1), m_origin(omp_get_wtime())
+	{
+		m_capacity = 1;
+		while (m_capacity < eventsPerThread) {
+			m_capacity <<= 1;
+		}
+		m_threads.reset(new ThreadBuffer[m_threadCount]);
+		for (int t = 0; t < m_threadCount; ++t) {
+			m_threads[t].events.resize(m_capacity);
+		}
+	}
+
+	// Records one complete event on the calling thread's ring. Events from threads beyond the count the
+	// recorder was made for are dropped
+	void record(int thread, const char* name, const char* category, double begin, double end, int32_t arg = -1) {
+		if (thread < 0 || thread >= m_threadCount) {
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		ThreadBuffer& buffer = m_threads[thread];
+		uint64_t index = buffer.written.load(std::memory_order_relaxed);
+		TraceEvent& event = buffer.events[index & (m_capacity - 1)];
+		event.name = name;
+		event.category = category;
+		event.begin = begin;
+		event.end = end;
+		event.arg = arg;
+		buffer.written.store(index + 1, std::memory_order_release);
+	}
+
+	// Total events recorded, including overwritten ones
+	uint64_t getRecorded() const {
+		uint64_t total = 0;
+		for (int t = 0; t < m_threadCount; ++t) {
+			total += m_threads[t].written.load(std::memory_order_acquire);
+		}
+		return total;
+	}
+	uint64_t getDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+	// Writes the buffered events as Chrome trace-event JSON. Call it while the solver is idle, events recorded
+	// during the write may be torn. Returns false if the file can't be written
+	bool write(const std::string& path) const {
+		std::ofstream out(path);
+		if (!out) {
+			return false;
+		}
+		out.precision(3);
+		out << std::fixed;
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		bool first = true;
+		for (int t = 0; t < m_threadCount; ++t) {
+			out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t
+				<< ",\"args\":{\"name\":\"omp thread " << t << "\"}}";
+			first = false;
+
+			const ThreadBuffer& buffer = m_threads[t];
+			uint64_t written = buffer.written.load(std::memory_order_acquire);
+			uint64_t begin = written > m_capacity ? written - m_capacity : 0;
+			for (uint64_t i = begin; i < written; ++i) {
+				const TraceEvent& event = buffer.events[i & (m_capacity - 1)];
+				out << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << t
+					<< ",\"ts\":" << (event.begin - m_origin) * 1.0e6 << ",\"dur\":" << (event.end - event.begin) * 1.0e6;
+				if (event.arg >= 0) {
+					out << ",\"args\":{\"index\":" << event.arg << "}";
+				}
+				out << "}";
+			}
+		}
+		out << "\n]}\n";
+		return static_cast<bool>(out);
+	}
+
+private:
+	// One ring per thread, on its own cache lines so threads don't false-share the write counters
+	struct alignas(64) ThreadBuffer {
+		std::vector<TraceEvent> events;
+		std::atomic<uint64_t> written{ 0 };
+	};
+
+	int m_threadCount;
+	size_t m_capacity;
+	double m_origin;
+	std::unique_ptr<ThreadBuffer[]> m_threads;
+	std::atomic<uint64_t> m_dropped{ 0 };
+};
+
+#endif
@@ -0,0 +1,628 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#include "MappedFile.h"
+#include "OutputQueue.h"
+#include "Particles.h"
+
+// Compressed trajectory files: positions and velocities of every particle for a series of frames, small enough to
+// keep every Nth step of a long run for offline analysis.
+//
+// Each frame is stored in particle id order. Positions are quantized to steps of the domain bounds' extent over
+// 2^positionBits levels, velocities to multiples of velocityQuantum. Levels aren't limited to the bounds, so a
+// particle that leaves them (an open boundary) is stored at the same resolution. A keyframe stores each value as the difference to the previous id's,
+// the frames after it as the difference to the same particle's value in the frame before, which is small since a
+// particle only moves a little between frames. The differences are Rice coded in blocks of 64, each block with the
+// parameter that fits its magnitudes. Every framesPerChunk frames is a keyframe, so a reader can seek to any frame
+// by decoding at most one chunk.
+//
+// File: TrajectoryFileHeader, then each frame as TrajectoryFrameHeader + payload, then an index with one
+// TrajectoryIndexEntry per frame and the TrajectoryFooter. A file whose writer never closed it has no index, and a
+// reader finds the frames by walking the headers instead.
+
+struct TrajectoryOptions {
+	int positionBits = 16; // Resolution of positions over the domain bounds' extent, 1 to 31
+	double velocityQuantum = 1.0 / 64.0; // Resolution of velocities, in units per second
+	size_t framesPerChunk = 32; // Frames from one keyframe to the next
+	size_t queueDepth = 3; // Frames that may wait for the writer thread
+	OutputOverflow overflow = OutputOverflow::Wait; // Whether a frame the queue has no room for holds the solver up or is skipped
+};
+
+struct TrajectoryFileHeader {
+	char magic[8]; // "FSIMTRAJ"
+	uint32_t version;
+	uint32_t positionBits;
+	uint64_t particleCount;
+	uint64_t framesPerChunk;
+	double minX, minY, maxX, maxY; // Origin and extent of the position levels, positions may lie outside
+	double velocityQuantum;
+};
+
+struct TrajectoryFrameHeader {
+	uint32_t magic; // TrajectoryFrameMagic
+	uint32_t flags; // TrajectoryKeyframe for keyframes
+	uint64_t step; // Solver step count when the frame was taken
+	double time; // Simulated time
+	uint64_t payloadBytes;
+};
+
+struct TrajectoryIndexEntry {
+	uint64_t offset; // Of the frame header
+	uint64_t step;
+	double time;
+	uint64_t flags;
+};
+
+struct TrajectoryFooter {
+	uint64_t indexOffset;
+	uint64_t frameCount;
+	char magic[8]; // "FSIMTEND"
+};
+
+static const char TrajectoryMagic[8] = { 'F', 'S', 'I', 'M', 'T', 'R', 'A', 'J' };
+static const char TrajectoryEndMagic[8] = { 'F', 'S', 'I', 'M', 'T', 'E', 'N', 'D' };
+static const uint32_t TrajectoryVersion = 1;
+static const uint32_t TrajectoryFrameMagic = 0x4D415246; // "FRAM"
+static const uint32_t TrajectoryKeyframe = 1;
+
+// Values per Rice block, each block picks its own parameter
+static const size_t TrajectoryBlockSize = 64;
+
+inline int countTrailingZeros64(uint64_t value)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	unsigned long index;
+	return _BitScanForward64(&index, value) ? static_cast<int>(index) : 64;
+#else
+	return value ? __builtin_ctzll(value) : 64;
+#endif
+}
+
+// Signed differences folded onto unsigned ones, small magnitudes of either sign staying small
+inline uint64_t zigzagEncode(int64_t value) { return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63); }
+inline int64_t zigzagDecode(uint64_t value) { return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1); }
+
+// Rice coder writing least significant bit first into a byte vector, whose storage is reused between frames
+class RiceEncoder {
+public:
+	explicit RiceEncoder(std::vector<uint8_t>& out) : m_out(out) { m_out.clear(); }
+
+	// Codes count values as blocks of TrajectoryBlockSize
+	void encode(const uint64_t* values, size_t count) {
+		for (size_t begin = 0; begin < count; begin += TrajectoryBlockSize) {
+			size_t end = std::min(count, begin + TrajectoryBlockSize);
+			uint64_t sum = 0;
+			for (size_t i = begin; i < end; ++i) {
+				sum += std::min(values[i], uint64_t(1) << 48); // Outliers go through the escape anyway
+			}
+			uint64_t mean = sum / (end - begin);
+			int k = 0;
+			while (k < 62 && (mean >> (k + 1)) != 0) {
+				++k;
+			}
+			put(static_cast<uint64_t>(k), 6);
+			for (size_t i = begin; i < end; ++i) {
+				putValue(values[i], k);
+			}
+		}
+	}
+
+	// Pads the last byte, call it once after the last encode
+	void finish() {
+		if (m_bits > 0) {
+			m_out.push_back(static_cast<uint8_t>(m_buffer));
+			m_buffer = 0;
+			m_bits = 0;
+		}
+	}
+
+private:
+	// Quotients from here on are escaped and the value written out at full width
+	static const uint64_t EscapeQuotient = 32;
+
+	void putValue(uint64_t value, int k) {
+		uint64_t quotient = value >> k;
+		if (quotient < EscapeQuotient) {
+			put((uint64_t(1) << quotient) - 1, static_cast<int>(quotient) + 1); // quotient ones, then a zero
+			put(value, k);
+		}
+		else {
+			int width = 64 - countLeadingZeros(value);
+			put((uint64_t(1) << EscapeQuotient) - 1, static_cast<int>(EscapeQuotient));
+			put(static_cast<uint64_t>(width - 1), 6);
+			put(value, width);
+		}
+	}
+
+	static int countLeadingZeros(uint64_t value) {
+		int zeros = 0;
+		while (zeros < 64 && !(value & (uint64_t(1) << 63 >> zeros))) {
+			++zeros;
+		}
+		return zeros;
+	}
+
+	void put(uint64_t value, int count) {
+		if (count > 32) {
+			put32(value & 0xFFFFFFFFu, 32);
+			value >>= 32;
+			count -= 32;
+		}
+		put32(value, count);
+	}
+	void put32(uint64_t value, int count) {
+		if (count == 0) return;
+		m_buffer |= (value & ((uint64_t(1) << count) - 1)) << m_bits;
+		m_bits += count;
+		while (m_bits >= 8) {
+			m_out.push_back(static_cast<uint8_t>(m_buffer));
+			m_buffer >>= 8;
+			m_bits -= 8;
+		}
+	}
+
+	std::vector<uint8_t>& m_out;
+	uint64_t m_buffer = 0;
+	int m_bits = 0;
+};
+
+class RiceDecoder {
+public:
+	RiceDecoder(const uint8_t* data, size_t size) : m_data(data), m_end(data + size) {}
+
+	// Decodes count values written by RiceEncoder::encode. Returns false if the data runs out
+	bool decode(uint64_t* values, size_t count) {
+		for (size_t begin = 0; begin < count; begin += TrajectoryBlockSize) {
+			size_t end = std::min(count, begin + TrajectoryBlockSize);
+			int k = static_cast<int>(get(6));
+			for (size_t i = begin; i < end; ++i) {
+				refill();
+				int ones = countTrailingZeros64(~m_buffer);
+				ones = ones < m_bits ? ones : m_bits;
+				if (ones < 32) {
+					consume(ones + 1);
+					values[i] = (static_cast<uint64_t>(ones) << k) | get(k);
+				}
+				else {
+					consume(32);
+					int width = static_cast<int>(get(6)) + 1;
+					values[i] = get(width);
+				}
+			}
+		}
+		return !m_overrun;
+	}
+
+private:
+	void refill() {
+		while (m_bits <= 56 && m_data < m_end) {
+			m_buffer |= static_cast<uint64_t>(*m_data++) << m_bits;
+			m_bits += 8;
+		}
+	}
+	void consume(int count) {
+		if (count > m_bits) {
+			m_overrun = true;
+			count = m_bits;
+		}
+		m_buffer = count < 64 ? m_buffer >> count : 0;
+		m_bits -= count;
+	}
+	uint64_t get(int count) {
+		if (count > 32) {
+			uint64_t low = get(32);
+			return low | (get(count - 32) << 32);
+		}
+		if (count == 0) return 0;
+		refill();
+		uint64_t value = m_buffer & ((uint64_t(1) << count) - 1);
+		consume(count);
+		return value;
+	}
+
+	const uint8_t* m_data;
+	const uint8_t* m_end;
+	uint64_t m_buffer = 0;
+	int m_bits = 0;
+	bool m_overrun = false;
+};
+
+// Quantization shared by the writer and reader
+struct TrajectoryQuantizer {
+	double minX = 0.0, minY = 0.0;
+	double stepX = 1.0, stepY = 1.0; // Domain extent over the number of position levels
+	double velocityQuantum = 1.0;
+	int64_t maxLevel = 1;
+
+	explicit TrajectoryQuantizer(const TrajectoryFileHeader& header)
+		: minX(header.minX), minY(header.minY), velocityQuantum(header.velocityQuantum)
+	{
+		maxLevel = (int64_t(1) << header.positionBits) - 1;
+		stepX = (header.maxX - header.minX) / maxLevel;
+		stepY = (header.maxY - header.minY) / maxLevel;
+	}
+
+	int64_t positionX(double x) const { return clampLevel(std::round((x - minX) / stepX)); }
+	int64_t positionY(double y) const { return clampLevel(std::round((y - minY) / stepY)); }
+	int64_t velocity(double v) const { return clampLevel(std::nearbyint(v / velocityQuantum)); }
+
+	// True for a level clampLevel cut off, the value it came from is lost
+	static bool isClamped(int64_t level) { return level == LevelLimit || level == -LevelLimit; }
+
+	double x(int64_t level) const { return minX + level * stepX; }
+	double y(int64_t level) const { return minY + level * stepY; }
+	double v(int64_t level) const { return level * velocityQuantum; }
+
+private:
+	static const int64_t LevelLimit = 1000000000000000ll;
+
+	// NaN and runaway particles are clamped, not left to overflow
+	static int64_t clampLevel(double level) {
+		const double limit = static_cast<double>(LevelLimit);
+		return static_cast<int64_t>(level > limit ? limit : (level < -limit || level != level ? -limit : level));
+	}
+};
+
+// Streams frames of a ParticleList to a trajectory file. addFrame copies the fields into a pooled frame buffer and
+// returns, quantizing, coding and writing happen on the writer thread of an OutputQueue. When the writer falls
+// queueDepth frames behind, addFrame waits for it or skips the frame, as the options say. The particle count is fixed
+// when the file is opened, and particle ids must be 0 to count - 1 (what addParticle hands out)
+template<typename Scalar>
+class BasicTrajectoryWriter {
+public:
+	BasicTrajectoryWriter() = default;
+	~BasicTrajectoryWriter() { close(); }
+
+	BasicTrajectoryWriter(const BasicTrajectoryWriter&) = delete;
+	BasicTrajectoryWriter& operator=(const BasicTrajectoryWriter&) = delete;
+
+	// Creates path and writes the file header, positions are quantized over the particle list's view (and beyond)
+	bool open(const std::string& path, BasicParticleList<Scalar>& particles, const TrajectoryOptions& options = TrajectoryOptions()) {
+		close();
+		if (options.positionBits < 1 || options.positionBits > 31 || !(options.velocityQuantum > 0.0) || options.framesPerChunk == 0) {
+			return false;
+		}
+		m_file = std::fopen(path.c_str(), "wb");
+		if (!m_file) {
+			return false;
+		}
+
+		TrajectoryFileHeader header = {};
+		std::memcpy(header.magic, TrajectoryMagic, sizeof(header.magic));
+		header.version = TrajectoryVersion;
+		header.positionBits = static_cast<uint32_t>(options.positionBits);
+		header.particleCount = particles.size();
+		header.framesPerChunk = options.framesPerChunk;
+		header.minX = 0.0;
+		header.minY = 0.0;
+		header.maxX = particles.getViewWidth();
+		header.maxY = particles.getViewHeight();
+		header.velocityQuantum = options.velocityQuantum;
+		m_header = header;
+		m_offset = 0;
+		m_frameCount = 0;
+		m_clamped = 0;
+		m_failed = !writeBytes(&header, sizeof(header));
+
+		// Everything the writer thread needs is sized here, so it settles into reusing it
+		const size_t count = particles.size();
+		for (int s = 0; s < Streams; ++s) {
+			m_levels[s].assign(count, 0);
+			m_previous[s].assign(count, 0);
+		}
+		m_residuals.resize(count);
+		m_index.clear();
+		m_overflow = options.overflow;
+		m_queue.start(options.queueDepth, [this](Frame& frame) {
+			if (!m_failed.load(std::memory_order_relaxed) && !writeFrame(frame)) {
+				m_failed.store(true, std::memory_order_relaxed);
+			}
+		});
+		for (size_t i = 0; i < m_queue.getDepth(); ++i) {
+			Frame& frame = m_queue.getFrame(i);
+			frame.x.resize(count); frame.y.resize(count);
+			frame.vx.resize(count); frame.vy.resize(count);
+			frame.ids.resize(count);
+		}
+		return !m_failed;
+	}
+
+	bool isOpen() const { return m_file != nullptr; }
+
+	// Queues the particles' current state as the next frame. A frame skipped because the writer is behind still
+	// returns true, see getDropped. Returns false if the particle count changed or an earlier frame failed to be
+	// written
+	bool addFrame(BasicParticleList<Scalar>& particles) {
+		if (!m_file || particles.size() != m_header.particleCount) {
+			return false;
+		}
+		if (Frame* frame = m_queue.acquire(m_overflow)) {
+			const size_t count = particles.size();
+			frame->step = particles.getStepCount();
+			frame->time = particles.getSimulatedTime();
+			parallelCopy(frame->x.data(), particles.positionsX(), count * sizeof(Scalar));
+			parallelCopy(frame->y.data(), particles.positionsY(), count * sizeof(Scalar));
+			parallelCopy(frame->vx.data(), particles.velocitiesX(), count * sizeof(Scalar));
+			parallelCopy(frame->vy.data(), particles.velocitiesY(), count * sizeof(Scalar));
+			parallelCopy(frame->ids.data(), particles.particleIds(), count * sizeof(uint32_t));
+			m_queue.publish();
+		}
+		return !m_failed.load(std::memory_order_relaxed);
+	}
+
+	// Writes the queued frames, the index and the footer, and closes the file. Returns false if anything failed
+	bool close() {
+		if (!m_file) {
+			return true;
+		}
+		m_queue.stop();
+
+		TrajectoryFooter footer = {};
+		footer.indexOffset = m_offset;
+		footer.frameCount = m_index.size();
+		std::memcpy(footer.magic, TrajectoryEndMagic, sizeof(footer.magic));
+		bool written = !m_failed && writeBytes(m_index.data(), m_index.size() * sizeof(TrajectoryIndexEntry)) && writeBytes(&footer, sizeof(footer));
+		written = std::fclose(m_file) == 0 && written;
+		m_file = nullptr;
+		return written;
+	}
+
+	size_t getFrameCount() const { return m_frameCount.load(std::memory_order_relaxed); } // Written so far
+	size_t getDropped() { return m_queue.getDropped(); } // Skipped because the writer was behind
+	size_t getClamped() const { return m_clamped.load(std::memory_order_relaxed); } // Values stored clamped (NaN or runaway)
+	uint64_t getBytesWritten() const { return m_offset; } // Only read it once the writer is closed
+
+private:
+	static const int Streams = 4; // x, y, vx, vy
+
+	struct Frame {
+		size_t step = 0;
+		double time = 0.0;
+		std::vector<Scalar> x, y, vx, vy;
+		std::vector<uint32_t> ids;
+	};
+
+	bool writeFrame(const Frame& frame) {
+		// Quantize into id order
+		const size_t count = frame.x.size();
+		TrajectoryQuantizer quantizer(m_header);
+		for (size_t i = 0; i < count; ++i) {
+			uint32_t id = frame.ids[i];
+			if (id >= count) {
+				return false;
+			}
+			m_levels[0][id] = quantizer.positionX(frame.x[i]);
+			m_levels[1][id] = quantizer.positionY(frame.y[i]);
+			m_levels[2][id] = quantizer.velocity(frame.vx[i]);
+			m_levels[3][id] = quantizer.velocity(frame.vy[i]);
+			for (int s = 0; s < Streams; ++s) {
+				if (TrajectoryQuantizer::isClamped(m_levels[s][id])) {
+					m_clamped.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+		}
+
+		const bool keyframe = m_frameCount % m_header.framesPerChunk == 0;
+		RiceEncoder encoder(m_payload);
+		for (int s = 0; s < Streams; ++s) {
+			const int64_t* levels = m_levels[s].data();
+			const int64_t* previous = m_previous[s].data();
+			for (size_t id = 0; id < count; ++id) {
+				int64_t reference = keyframe ? (id > 0 ? levels[id - 1] : 0) : previous[id];
+				m_residuals[id] = zigzagEncode(levels[id] - reference);
+			}
+			encoder.encode(m_residuals.data(), count);
+			m_levels[s].swap(m_previous[s]);
+		}
+		encoder.finish();
+
+		TrajectoryFrameHeader header = {};
+		header.magic = TrajectoryFrameMagic;
+		header.flags = keyframe ? TrajectoryKeyframe : 0;
+		header.step = frame.step;
+		header.time = frame.time;
+		header.payloadBytes = m_payload.size();
+
+		TrajectoryIndexEntry entry = {};
+		entry.offset = m_offset;
+		entry.step = header.step;
+		entry.time = header.time;
+		entry.flags = header.flags;
+		m_index.push_back(entry);
+
+		if (!writeBytes(&header, sizeof(header)) || !writeBytes(m_payload.data(), m_payload.size())) {
+			return false;
+		}
+		m_frameCount.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	bool writeBytes(const void* data, size_t size) {
+		if (size == 0) return true;
+		if (std::fwrite(data, 1, size, m_file) != size) {
+			return false;
+		}
+		m_offset += size;
+		return true;
+	}
+
+	FILE* m_file = nullptr;
+	TrajectoryFileHeader m_header = {};
+	uint64_t m_offset = 0;
+	std::atomic<size_t> m_frameCount{ 0 };
+	std::atomic<bool> m_failed{ false };
+	std::atomic<size_t> m_clamped{ 0 };
+
+	OutputQueue<Frame> m_queue;
+	OutputOverflow m_overflow = OutputOverflow::Wait;
+
+	// Writer thread state
+	std::vector<int64_t> m_levels[Streams], m_previous[Streams];
+	std::vector<uint64_t> m_residuals;
+	std::vector<uint8_t> m_payload;
+	std::vector<TrajectoryIndexEntry> m_index;
+};
+
+typedef BasicTrajectoryWriter<Real> TrajectoryWriter;
+
+// Reads trajectory files, frames come out in particle id order. Reading the frames in order decodes each once,
+// seeking back or ahead decodes from the keyframe before the target
+class TrajectoryReader {
+public:
+	// Maps path and finds its frames. Returns false with the reason in error if it isn't a readable trajectory
+	bool open(const std::string& path, std::string& error) {
+		m_frames.clear();
+		m_decoded = SIZE_MAX;
+		if (!m_file.open(path)) {
+			error = "can't open " + path;
+			return false;
+		}
+		if (m_file.size() < sizeof(m_header)) {
+			error = "not a trajectory";
+			return false;
+		}
+		std::memcpy(&m_header, m_file.data(), sizeof(m_header));
+		if (std::memcmp(m_header.magic, TrajectoryMagic, sizeof(m_header.magic)) != 0) {
+			error = "not a trajectory";
+			return false;
+		}
+		if (m_header.version != TrajectoryVersion || m_header.positionBits < 1 || m_header.positionBits > 31 || m_header.framesPerChunk == 0) {
+			error = "unsupported trajectory version " + std::to_string(m_header.version);
+			return false;
+		}
+
+		if (!readIndex()) {
+			scanFrames(); // Never closed, e.g. the run crashed
+		}
+		const size_t count = static_cast<size_t>(m_header.particleCount);
+		for (int s = 0; s < Streams; ++s) {
+			m_levels[s].assign(count, 0);
+		}
+		m_residuals.resize(count);
+		return true;
+	}
+
+	size_t getParticleCount() const { return static_cast<size_t>(m_header.particleCount); }
+	size_t getFrameCount() const { return m_frames.size(); }
+	size_t getFrameStep(size_t frame) const { return static_cast<size_t>(m_frames[frame].step); }
+	double getFrameTime(size_t frame) const { return m_frames[frame].time; }
+	const TrajectoryFileHeader& getHeader() const { return m_header; }
+
+	// Decodes a frame into arrays of getParticleCount() values, indexed by particle id. Any of them may be null.
+	// Returns false if the frame is corrupt
+	template<typename T>
+	bool readFrame(size_t frame, T* x, T* y, T* vx, T* vy) {
+		if (frame >= m_frames.size()) {
+			return false;
+		}
+		// Continue from the last decoded frame when it is in the same chunk and before the target
+		size_t next = frame;
+		while (!(m_frames[next].flags & TrajectoryKeyframe) && next > 0 && next != m_decoded + 1) {
+			next--;
+		}
+		if (!(m_frames[next].flags & TrajectoryKeyframe) && next != m_decoded + 1) {
+			return false;
+		}
+		for (; next <= frame; ++next) {
+			if (!decodeFrame(next)) {
+				m_decoded = SIZE_MAX;
+				return false;
+			}
+			m_decoded = next;
+		}
+
+		TrajectoryQuantizer quantizer(m_header);
+		const size_t count = getParticleCount();
+		for (size_t id = 0; id < count; ++id) {
+			if (x) x[id] = static_cast<T>(quantizer.x(m_levels[0][id]));
+			if (y) y[id] = static_cast<T>(quantizer.y(m_levels[1][id]));
+			if (vx) vx[id] = static_cast<T>(quantizer.v(m_levels[2][id]));
+			if (vy) vy[id] = static_cast<T>(quantizer.v(m_levels[3][id]));
+		}
+		return true;
+	}
+
+private:
+	static const int Streams = 4;
+
+	bool readIndex() {
+		TrajectoryFooter footer;
+		if (m_file.size() < sizeof(m_header) + sizeof(footer)) {
+			return false;
+		}
+		std::memcpy(&footer, m_file.data() + m_file.size() - sizeof(footer), sizeof(footer));
+		if (std::memcmp(footer.magic, TrajectoryEndMagic, sizeof(footer.magic)) != 0
+			|| footer.indexOffset + footer.frameCount * sizeof(TrajectoryIndexEntry) + sizeof(footer) != m_file.size()) {
+			return false;
+		}
+		m_frames.resize(static_cast<size_t>(footer.frameCount));
+		std::memcpy(m_frames.data(), m_file.data() + footer.indexOffset, m_frames.size() * sizeof(TrajectoryIndexEntry));
+		return true;
+	}
+
+	void scanFrames() {
+		uint64_t offset = sizeof(m_header);
+		TrajectoryFrameHeader header;
+		while (offset + sizeof(header) <= m_file.size()) {
+			std::memcpy(&header, m_file.data() + offset, sizeof(header));
+			if (header.magic != TrajectoryFrameMagic || header.payloadBytes > m_file.size() - offset - sizeof(header)) {
+				break; // The frame the writer was in the middle of
+			}
+			TrajectoryIndexEntry entry = {};
+			entry.offset = offset;
+			entry.step = header.step;
+			entry.time = header.time;
+			entry.flags = header.flags;
+			m_frames.push_back(entry);
+			offset += sizeof(header) + header.payloadBytes;
+		}
+	}
+
+	bool decodeFrame(size_t frame) {
+		TrajectoryFrameHeader header;
+		uint64_t offset = m_frames[frame].offset;
+		if (offset + sizeof(header) > m_file.size()) {
+			return false;
+		}
+		std::memcpy(&header, m_file.data() + offset, sizeof(header));
+		if (header.magic != TrajectoryFrameMagic || header.payloadBytes > m_file.size() - offset - sizeof(header)) {
+			return false;
+		}
+
+		const bool keyframe = (header.flags & TrajectoryKeyframe) != 0;
+		const size_t count = getParticleCount();
+		RiceDecoder decoder(reinterpret_cast<const uint8_t*>(m_file.data() + offset + sizeof(header)), static_cast<size_t>(header.payloadBytes));
+		for (int s = 0; s < Streams; ++s) {
+			if (!decoder.decode(m_residuals.data(), count)) {
+				return false;
+			}
+			int64_t* levels = m_levels[s].data();
+			for (size_t id = 0; id < count; ++id) {
+				int64_t reference = keyframe ? (id > 0 ? levels[id - 1] : 0) : levels[id];
+				levels[id] = reference + zigzagDecode(m_residuals[id]);
+			}
+		}
+		return true;
+	}
+
+	MappedFile m_file;
+	TrajectoryFileHeader m_header = {};
+	std::vector<TrajectoryIndexEntry> m_frames;
+	size_t m_decoded = SIZE_MAX; // Frame m_levels holds
+	std::vector<int64_t> m_levels[Streams];
+	std::vector<uint64_t> m_residuals;
+};
+
+#endif
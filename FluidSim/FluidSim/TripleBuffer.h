@@ -0,0 +1,42 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+
+// Lock-free single producer / single consumer triple buffer.
+// The writer fills writeBuffer() and publish()es it, the reader calls update() to pick up the latest published
+// buffer and reads readBuffer(). Neither side ever waits: the writer always has a free buffer, and the reader
+// keeps the last one it got until a newer one is published. Intermediate buffers the reader never saw are dropped.
+template<typename T>
+class TripleBuffer {
+public:
+	// Writer side
+	T& writeBuffer() { return m_buffers[m_write]; }
+	void publish() {
+		// Hand the filled buffer to the shared slot and take back whichever buffer was there
+		unsigned previous = m_shared.exchange(m_write | FreshBit, std::memory_order_acq_rel);
+		m_write = previous & IndexMask;
+	}
+
+	// Reader side, returns true if a newer buffer was published since the last call
+	bool update() {
+		if ((m_shared.load(std::memory_order_relaxed) & FreshBit) == 0) {
+			return false;
+		}
+		unsigned previous = m_shared.exchange(m_read, std::memory_order_acq_rel);
+		m_read = previous & IndexMask;
+		return true;
+	}
+	const T& readBuffer() const { return m_buffers[m_read]; }
+
+private:
+	static const unsigned IndexMask = 3;
+	static const unsigned FreshBit = 4; // Set while the shared slot holds a buffer the reader hasn't taken
+
+	T m_buffers[3];
+	unsigned m_write = 0; // Only touched by the writer
+	unsigned m_read = 1; // Only touched by the reader
+	std::atomic<unsigned> m_shared{ 2 };
+};
+
+#endif
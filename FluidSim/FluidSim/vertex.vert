@@ -1,11 +1,11 @@
 #version 330 core
 layout (location = 0) in vec2 aPos;
-uniform int windowWidth;
-uniform int windowHeight;
+uniform float viewWidth;
+uniform float viewHeight;
 out vec3 ourColor;
 void main()
 {
-	float xPos = (aPos.x - windowWidth / 2.0f) / windowWidth;
-	float yPos = (aPos.y - windowHeight / 2.0f) / windowHeight;
+	float xPos = (aPos.x - viewWidth / 2.0f) / viewWidth;
+	float yPos = (aPos.y - viewHeight / 2.0f) / viewHeight;
 	gl_Position = vec4(xPos, yPos, 1.0, 1.0);
 }
\ No newline at end of file